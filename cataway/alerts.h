@@ -0,0 +1,80 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <cstring>
+
+// Colors of the dispenser alerts, as shown by /dispenserStatus
+enum class AlertColor : uint8_t {
+    Green,
+    Yellow,
+    Orange,
+    Red,
+};
+
+enum class AlertKind {
+    EmptyTank,
+    ExpiredFood,
+    NeedsRefreshment,
+};
+
+const int NrAlerts = 3;
+const int NrAlertColors = 4;
+
+inline const char* alertColorName(AlertColor color) {
+    static const char* names[NrAlertColors] = {"Green", "Yellow", "Orange", "Red"};
+    return names[static_cast<int>(color)];
+}
+
+// Green for a name that is not a color
+inline AlertColor alertColorFromName(const char* name) {
+    for (int color = 0; color < NrAlertColors; color++)
+        if (strcmp(name, alertColorName(static_cast<AlertColor>(color))) == 0)
+            return static_cast<AlertColor>(color);
+    return AlertColor::Green;
+}
+
+// The alerts of one dispenser, packed in one atomic word: 2 bits of color per alert in the low byte and,
+// above it, the number of changes so far. A reader gets all the colors and the change count in one load,
+// without the lock of the dispenser; comparing two counts tells whether anything changed in between.
+// Only one thread writes at a time (the one holding the dispenser's lock).
+class AlertState {
+public:
+    static const int ColorBits = 2;
+    static const int CountShift = 8;
+
+    struct Snapshot {
+        uint64_t word;
+
+        AlertColor color(AlertKind kind) const {
+            return static_cast<AlertColor>((word >> (static_cast<int>(kind) * ColorBits)) & (NrAlertColors - 1));
+        }
+
+        // All the colors, as one small number (0 .. 63)
+        unsigned colors() const {
+            return word & ((1u << (NrAlerts * ColorBits)) - 1);
+        }
+
+        uint64_t changes() const {
+            return word >> CountShift;
+        }
+    };
+
+    Snapshot load() const {
+        return {word.load(std::memory_order_acquire)};
+    }
+
+    // Returns true when the color was different
+    bool set(AlertKind kind, AlertColor color) {
+        uint64_t current = word.load(std::memory_order_relaxed);
+        int shift = static_cast<int>(kind) * ColorBits;
+        uint64_t colors = (current & ~(uint64_t(NrAlertColors - 1) << shift)) | (uint64_t(color) << shift);
+        if (colors == current)
+            return false;
+        word.store(colors + (uint64_t(1) << CountShift), std::memory_order_release);
+        return true;
+    }
+
+private:
+    std::atomic<uint64_t> word{0};      // all Green, no changes
+};
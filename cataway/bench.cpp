@@ -0,0 +1,798 @@
+// Benchmarks of the CatAway server.
+//
+//   ./cataway-bench micro                   CatAway::set and get (against the if/else dispatch they replaced),
+//                                           setRecFood, setNextFoodRefill, consume, getSettingsView, the validators
+//                                           and the cat registry, ns per call (and its bytes per cat)
+//   ./cataway-bench inproc [options]        the handlers' work (device lookup, lock, CatAway, log) without HTTP
+//   ./cataway-bench loopback [options]      real HTTP requests over keep-alive loopback connections
+//   ./cataway-bench telemetry [options]     weight writes: POST /settings/add against binary frames over TCP
+//   ./cataway-bench cores [options]         one shared endpoint against one pinned endpoint per core (CatAwayCores),
+//                                           in process and over loopback, from 1 core to all of them
+//
+// Options: --threads 1,2,4,8  --seconds 3  --reads 90 (% of GETs)  --devices 1000
+//          --cores 1,2,4,...,all (cores)
+//          --server-threads 4 (loopback, telemetry)  --port 9080 (loopback, telemetry; the frames go to port + 1)
+//          --data-dir DIR (log the writes there)
+//
+// For every thread count the throughput and the p50/p99/p999 latency are printed.
+
+#define CATAWAY_NO_MAIN
+#include "main.cpp"
+
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <cstring>
+#include <random>
+#include <regex>
+
+// Latencies of one thread, in the log-linear buckets of the /metrics histograms
+struct Latencies {
+    LatencyHistogram histogram;
+
+    void add(const Latencies& other) {
+        for (int bucket = 0; bucket < LatencyHistogram::NrBuckets; bucket++)
+            histogram.buckets[bucket] = histogram.buckets[bucket] + other.histogram.buckets[bucket];
+        histogram.count = histogram.count + other.histogram.count;
+        histogram.sum = histogram.sum + other.histogram.sum;
+    }
+
+    // Upper bound of the bucket holding the given fraction of the samples, in ns
+    uint64_t percentile(double fraction) const {
+        uint64_t rank = static_cast<uint64_t>(fraction * histogram.count), seen = 0;
+        for (int bucket = 0; bucket < LatencyHistogram::NrBuckets; bucket++) {
+            seen += histogram.buckets[bucket];
+            if (seen > rank)
+                return LatencyHistogram::upperBound(bucket);
+        }
+        return 0;
+    }
+};
+
+// One keep-alive HTTP/1.1 connection to the endpoint under test
+class Connection {
+public:
+    explicit Connection(uint16_t port) {
+        fd = socket(AF_INET, SOCK_STREAM, 0);
+        sockaddr_in addr = {};
+        addr.sin_family = AF_INET;
+        addr.sin_port = htons(port);
+        addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        if (fd < 0 || connect(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) != 0) {
+            perror("connect");
+            exit(1);
+        }
+        int one = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    }
+
+    ~Connection() {
+        close(fd);
+    }
+
+    // Sends a request and reads its whole answer; returns the status code, 0 when the connection failed
+    int request(const char* method, const string& path) {
+        string text = string(method) + " " + path + " HTTP/1.1\r\nHost: localhost\r\nContent-Length: 0\r\n\r\n";
+        for (size_t sent = 0; sent < text.size();) {
+            ssize_t n = send(fd, text.data() + sent, text.size() - sent, MSG_NOSIGNAL);
+            if (n <= 0)
+                return 0;
+            sent += n;
+        }
+
+        size_t headersEnd;
+        while ((headersEnd = buffer.find("\r\n\r\n")) == string::npos)
+            if (!receive())
+                return 0;
+        string headers = buffer.substr(0, headersEnd);
+        transform(headers.begin(), headers.end(), headers.begin(), ::tolower);
+        size_t length = 0;
+        size_t field = headers.find("content-length:");
+        if (field != string::npos)
+            length = strtoul(headers.c_str() + field + 15, nullptr, 10);
+        while (buffer.size() < headersEnd + 4 + length)
+            if (!receive())
+                return 0;
+
+        int code = atoi(buffer.c_str() + 9);        // "HTTP/1.1 200 OK"
+        buffer.erase(0, headersEnd + 4 + length);
+        return code;
+    }
+
+    // Sends telemetry frames and reads their status bytes; returns how many were applied
+    int exchange(const string& frames, size_t count) {
+        if (send(fd, frames.data(), frames.size(), MSG_NOSIGNAL) != (ssize_t)frames.size())
+            return 0;
+        while (buffer.size() < count)
+            if (!receive())
+                return 0;
+        int applied = static_cast<int>(std::count(buffer.begin(), buffer.begin() + count,
+                                                  static_cast<char>(Telemetry::Status::Applied)));
+        buffer.erase(0, count);
+        return applied;
+    }
+
+private:
+    bool receive() {
+        char chunk[4096];
+        ssize_t n = recv(fd, chunk, sizeof(chunk), 0);
+        if (n <= 0)
+            return false;
+        buffer.append(chunk, n);
+        return true;
+    }
+
+    int fd;
+    string buffer;
+};
+
+// The dispatch of CatAway::set and get before the typed Setting enum, as the baseline of micro: the if/else
+// chains are copied as they were (but for get's `return 0`, which built a string from a null pointer); the
+// fields and helpers they reach are reduced to what keeps the chains themselves the cost being measured.
+class LegacySettings {
+public:
+        int set(std::string name, std::string value) {
+            struct tm tm_;
+            if(name == "weight") {
+                weight = stof(value);
+                globalWeight = weight;
+                this->setRecFood();
+                return 1;
+            } else if (name == "age") {
+                age = stof(value);
+                globalAge = age;
+                this->setRecFood();
+                return 1;
+            } else if (name == "eatingSpeed") {
+                eatingSpeed = value;
+                globalEatingSpeed = eatingSpeed;
+                this->setBreaks();
+                return 1;
+            } else if (name == "waterBowlWeightG"){
+                waterBowlCapacityMl = stoi(value);
+                return 1;
+            } else if (name == "waterRefSchedule"){
+                waterRefSchedule = value;
+                return 1;
+            } else if (name == "foodExpDate"){
+                strptime(value.c_str(), "%d.%m.%Y %H:%M", &tm_);
+                foodExpDate = mktime(&tm_);
+                this->setNextFoodRefill();
+                return 1;
+            } else if (name == "emptyFoodTank"){
+                emptyFoodTank = (value == "1");
+                if(emptyFoodTank == true)
+                {
+                    this->refillFood = true;
+                    this->Alert["emptyTank"] = "Yellow";
+                    this->setNextFoodRefill();
+                }
+                return 1;
+            } else if (name == "emptyWaterTank"){
+                emptyWaterTank = (value == "1");
+                if(emptyWaterTank == true)
+                {
+                    this->Alert["emptyTank"] = "Yellow";
+                    this->setNextWaterRefill();
+                }
+                return 1;
+            } else if (name == "lastConsumedWater"){
+                lastConsumedWater = stoi(value);
+                if(lastConsumedWater <= this->currentQuantityWaterMl){
+                    this->currentQuantityWaterMl -= lastConsumedWater;
+                    this->setNextWaterRefill();
+                } else {
+                    this->currentQuantityWaterMl = 0;
+                    this->emptyWaterTank = true;
+                    this->Alert["emptyTank"] = "Yellow";
+                    this->setNextWaterRefill();
+                }
+                return 1;
+            } else if (name == "lastConsumedFood"){
+                lastConsumedFood = stoi(value);
+                if(!this->Expired()) {
+                    if(lastConsumedWater <= this->currentQuantityFoodG){
+                        this->currentQuantityFoodG -= lastConsumedFood;
+                        this->setNextFoodRefill();
+                    } else {
+                    this->currentQuantityFoodG = 0;
+                    this->emptyFoodTank = true;
+                    this->refillFood = true;
+                    this->Alert["emptyTank"] = "Yellow";
+                    this->setNextFoodRefill();
+                    } 
+                } else {
+                    this->refillFood = true;
+                    this->expiredFood = true;
+                    this->Alert["expiredFood"] = "Red";
+                    this->setNextFoodRefill();
+                }
+                return 1;
+            } 
+            else if(name == "foodIsRefilled")
+            {
+                this->foodIsRefilled = (value == "true");
+                if(foodIsRefilled)
+                    this->currentQuantityFoodG = tankSizeFoodG;
+                this->foodIsRefilled = false;
+                if(!this->emptyWaterTank)
+                    this->Alert["emptyTank"] = "Green";
+
+                this->Alert["expiredFood"] = "Green";
+            }
+            else if(name == "waterIsRefilled")
+            {
+                this->waterIsRefilled = (value == "true");
+                time_t now = time(0);
+                tm *gmtm = gmtime(&now);                          
+                gmtm->tm_hour += 3;                                              
+                this->waterLastRefreshed = mktime(gmtm);
+
+                if(waterIsRefilled)
+                    this->currentQuantityWaterMl = tankSizeWaterMl;
+                this->waterIsRefilled = false;
+                if(!this->emptyFoodTank)
+                    this->Alert["emptyTank"] = "Green";
+                return 1;
+            }
+            else if(name == "breakDuration"){ 
+                return breakDuration;
+                }
+            else if(name == "waterLastRefreshed")
+            {
+                strptime(value.c_str(), "%d.%m.%Y %H:%M", &tm_);
+                waterLastRefreshed = mktime(&tm_);
+                this->setWaterRefresh();
+                return 1;
+            }
+            else if(name == "waterIsRefreshed")
+            {
+                this->waterIsRefreshed = (value == "true");
+                if(waterIsRefreshed){
+                    this->Alert["needsRefreshment"] = "Green";
+                    this->waterIsRefilled = false;
+                }
+            }
+            return 0;
+        }
+
+        // Getter
+        string get(std::string name){
+            struct tm *tm_;
+            char* dt;
+            if(name == "weight") {
+                return to_string(weight);
+            } else if (name == "age") {
+                return to_string(age);
+            } else if (name == "eatingSpeed") {
+                return eatingSpeed;
+            } else if (name == "feedingSchedule"){
+                return feedingSchedule;
+            } else if (name == "waterBowlCapacityMl"){
+                return to_string(waterBowlCapacityMl);
+            } else if (name == "waterRefSchedule"){
+                return waterRefSchedule;
+            } else if (name == "foodExpDate"){
+                dt = ctime(&foodExpDate);
+                string someString(dt);
+                return someString;
+            } else if (name == "emptyFoodTank"){
+                return emptyFoodTank ? "true" : "false";
+            } else if (name == "emptyWaterTank"){
+                return emptyWaterTank ? "true" : "false";
+            } else if (name == "recFoodG"){
+                return to_string(recFoodG);
+            } else if (name == "nrBreaks"){
+                return to_string(nrBreaks);
+            }   else if (name == "currentQuantityWaterMl"){
+                return to_string(currentQuantityWaterMl);
+            }   else if (name == "refreshWater"){
+                return refreshWater ? "true" : "false";
+            }   else if (name == "currentQuantityFoodG"){
+                return to_string(currentQuantityFoodG);
+            }   else if (name == "refillFood"){
+                return refillFood ? "true" : "false";
+            }   else if (name == "nextFoodRefill"){
+                dt = ctime(&nextFoodRefill);
+                string someString(dt);
+                return someString;
+            }   else if (name == "nextWaterRefill"){
+                dt = ctime(&nextWaterRefill);
+                string someString(dt);
+                return someString;
+            }   else if (name == "lastConsumedWater"){
+                return to_string(lastConsumedWater);
+            }   else if (name == "lastConsumedFood"){
+                return to_string(lastConsumedFood);
+            }   else if(name == "tankSizeFoodG"){
+                return to_string(tankSizeFoodG);
+            }   else if(name == "tankSizeWaterMl"){
+                return to_string(tankSizeWaterMl);
+            }   else if(name == "breakDuration"){
+                return to_string(breakDuration);
+            }   else if(name == "waterLastRefreshed"){
+                dt = ctime(&waterLastRefreshed);
+                string someString(dt);
+                return someString;
+            } 
+            (void)tm_;
+            return "";
+        }
+
+private:
+    void setRecFood() {
+        recFoodG = recommendedFoodG(age, weight);
+    }
+
+    void setBreaks() {
+        int breaks = nrBreaksFor(eatingSpeed);
+        if (breaks >= 0)
+            nrBreaks = breaks;
+    }
+
+    // the schedule and refill predictions are not part of the dispatch
+    void setNextFoodRefill() { }
+    void setNextWaterRefill() { }
+    void setWaterRefresh() { }
+    bool Expired() { return false; }
+
+    float weight = -1.0, age = -1.0;
+    float globalWeight = -1.0, globalAge = -1.0;
+    string eatingSpeed, globalEatingSpeed;
+    string feedingSchedule = "", waterRefSchedule = "";
+    int waterBowlCapacityMl = -1;
+    time_t foodExpDate = (time_t)(-1), nextFoodRefill = (time_t)(-1), nextWaterRefill = (time_t)(-1);
+    time_t waterLastRefreshed = (time_t)(-1);
+    bool emptyFoodTank = false, emptyWaterTank = false, expiredFood = false, refreshWater = false, refillFood = false;
+    bool foodIsRefilled = false, waterIsRefilled = false, waterIsRefreshed = false;
+    int recFoodG = -1, nrBreaks = 0, breakDuration = -1;
+    int currentQuantityWaterMl = 0, currentQuantityFoodG = 0, lastConsumedWater = 0, lastConsumedFood = 0;
+    const int tankSizeFoodG = 1000, tankSizeWaterMl = 3000;
+    map<string, string> Alert;
+};
+
+class CatAwayBench {
+public:
+    struct Options {
+        vector<int> threads = {1, 2, 4, 8};
+        double seconds = 3;
+        int reads = 90;
+        int devices = 1000;
+        int serverThreads = 4;
+        uint16_t port = 9080;
+        string dataDir;
+        vector<int> cores;          // empty: the powers of two up to all the cores, and all of them
+    };
+
+    explicit CatAwayBench(const Options& options) : options(options) {}
+
+    void micro() {
+        using CatAway = CatAwayEndpoint::CatAway;
+        CatAway cat;
+        cat.set(Setting::Age, "3");
+        cat.set(Setting::Weight, "4.2");
+        const string weight = "4.2";
+
+        // The typed dispatch (by enum, and by name through settingFromName) against the if/else chains it replaced,
+        // for a name at the head of the chains, one in the middle and one at the end
+        LegacySettings legacy;
+        legacy.set("age", "3");
+        legacy.set("weight", weight);
+        const string slow = "slow";
+        printf("%-28s %10s %10s %10s\n", "call", "ns/call", "p50 ns", "p99 ns");
+        measureCalls("set(weight)", [&] { cat.set(Setting::Weight, weight); });
+        measureCalls("set(\"weight\")", [&] { cat.set("weight", weight); });
+        measureCalls("legacy set(\"weight\")", [&] { legacy.set("weight", weight); });
+        measureCalls("set(eatingSpeed)", [&] { cat.set(Setting::EatingSpeed, slow); });
+        measureCalls("set(\"eatingSpeed\")", [&] { cat.set("eatingSpeed", slow); });
+        measureCalls("legacy set(\"eatingSpeed\")", [&] { legacy.set("eatingSpeed", slow); });
+        measureCalls("get(weight)", [&] { cat.get(Setting::Weight); });
+        measureCalls("get(\"weight\")", [&] { cat.get("weight"); });
+        measureCalls("legacy get(\"weight\")", [&] { legacy.get("weight"); });
+        measureCalls("get(recFoodG)", [&] { cat.get(Setting::RecFoodG); });
+        measureCalls("get(\"recFoodG\")", [&] { cat.get("recFoodG"); });
+        measureCalls("legacy get(\"recFoodG\")", [&] { legacy.get("recFoodG"); });
+        measureCalls("get(breakDuration)", [&] { cat.get(Setting::BreakDuration); });
+        measureCalls("get(\"breakDuration\")", [&] { cat.get("breakDuration"); });
+        measureCalls("legacy get(\"breakDuration\")", [&] { legacy.get("breakDuration"); });
+        measureCalls("setRecFood", [&] { cat.setRecFood(); });
+        measureCalls("setNextFoodRefill", [&] { cat.setNextFoodRefill(); });
+
+        // The consumption path: a dispenser's buffered readings (history, tank, one refill prediction each for
+        // food and water), and a single reading set by name
+        vector<ConsumptionEvent> events;
+        time_t now = dispenserClock.romaniaTime();
+        for (int i = 0; i < 16; i++)
+            events.push_back({i % 2 ? ConsumptionEvent::Food : ConsumptionEvent::Water, now - (16 - i) * 60, i % 2 ? 5 : 10});
+        const string grams = "5";
+        measureCalls("consume(16 events)", [&] { cat.consume(events); });
+        measureCalls("set(lastConsumedFood)", [&] { cat.set(Setting::LastConsumedFood, grams); });
+        measureCalls("getSettingsView", [&] { cat.getSettingsView(); });
+
+        // The cat profiles, by columns: a lookup (its body rendered once, then kept), and one scan of the whole fleet
+        CatRegistry cats;
+        fillCats(cats);
+        shared_ptr<const string> details;
+        measureCalls("findDetails", [&] { details = cats.findDetails("cat" + to_string(options.devices / 2)); });
+        double meanWeight = 0;
+        measureCalls("fleetStats", [&] { meanWeight += cats.fleetStats().meanWeight; });
+        printf("%d cats, %.1f bytes per cat%s\n", options.devices, static_cast<double>(cats.memoryBytes()) / options.devices,
+               meanWeight < 0 ? " " : "");
+
+        // The generated DFA against std::regex on the same rule, for a valid and an invalid value
+        const string schedule = "08:00-13:00-19:00-", bad = "08:00-25:00-";
+        std::regex weightRule(Validators::weight.rule), scheduleRule(Validators::feedingSchedule.rule);
+        bool sink = false;
+        measureCalls("dfa(weight)", [&] { sink ^= Validators::matches(Validators::weight, weight); });
+        measureCalls("regex(weight)", [&] { sink ^= std::regex_match(weight, weightRule); });
+        measureCalls("dfa(schedule)", [&] { sink ^= Validators::matches(Validators::feedingSchedule, schedule); });
+        measureCalls("regex(schedule)", [&] { sink ^= std::regex_match(schedule, scheduleRule); });
+        measureCalls("dfa(bad schedule)", [&] { sink ^= Validators::matches(Validators::feedingSchedule, bad); });
+        measureCalls("regex(bad schedule)", [&] { sink ^= std::regex_match(bad, scheduleRule); });
+        if (sink)
+            printf("\n");
+    }
+
+    // The work of the settings handlers, without Pistache: its ResponseWriter can only be made by a live connection
+    void inproc() {
+        CatAwayEndpoint endpoint(Address(Ipv4::loopback(), Port(options.port)), options.dataDir);
+        populate(endpoint);
+        const string weight = "4.2";
+
+        printHeader("inproc", options.reads);
+        for (int threads : options.threads) {
+            run(threads, [&](int, std::mt19937& random) {
+                uniform_int_distribution<int> pickDevice(0, options.devices - 1), pickOp(0, 99);
+                settingsRequest(endpoint, "cat" + to_string(pickDevice(random)), pickOp(random) < options.reads, weight);
+            });
+        }
+    }
+
+    // Requests through the real Http::Endpoint and Rest::Router
+    void loopback() {
+        CatAwayEndpoint endpoint(Address(Ipv4::loopback(), Port(options.port)), options.dataDir);
+        populate(endpoint);
+        endpoint.init(options.serverThreads);
+        endpoint.start();
+
+        printHeader("loopback, " + to_string(options.serverThreads) + " server threads", options.reads);
+        for (int threads : options.threads) {
+            vector<unique_ptr<Connection>> connections;
+            for (int i = 0; i < threads; i++)
+                connections.push_back(make_unique<Connection>(options.port));
+            run(threads, [&](int thread, std::mt19937& random) {
+                uniform_int_distribution<int> pickDevice(0, options.devices - 1), pickOp(0, 99);
+                string device = "/device/cat" + to_string(pickDevice(random));
+                if (pickOp(random) < options.reads)
+                    connections[thread]->request("GET", device + "/settings/weight");
+                else
+                    connections[thread]->request("POST", device + "/settings/add/weight/4.2");
+            });
+        }
+        endpoint.stop();
+    }
+
+    // The same weight writes as HTTP requests and as telemetry frames, one or Batch per round trip
+    void telemetry() {
+        const int Batch = 32;
+        CatAwayEndpoint endpoint(Address(Ipv4::loopback(), Port(options.port)), options.dataDir);
+        populate(endpoint);
+        endpoint.init(options.serverThreads);
+        endpoint.start();
+        uint16_t telemetryPort = options.port + 1;
+        if (!endpoint.startTelemetry(telemetryPort, options.serverThreads))
+            exit(1);
+
+        vector<string> frames;
+        for (int i = 0; i < options.devices; i++)
+            frames.push_back(weightFrame("cat" + to_string(i), 420));
+
+        for (int perRoundTrip : {0, 1, Batch}) {
+            printHeader(perRoundTrip == 0 ? string("POST /device/:id/settings/add/weight/4.2")
+                                          : "telemetry frames over TCP, " + to_string(perRoundTrip) + " per round trip", 0);
+            for (int threads : options.threads) {
+                vector<unique_ptr<Connection>> connections;
+                for (int i = 0; i < threads; i++)
+                    connections.push_back(make_unique<Connection>(perRoundTrip == 0 ? options.port : telemetryPort));
+                run(threads, [&](int thread, std::mt19937& random) {
+                    uniform_int_distribution<int> pickDevice(0, options.devices - 1);
+                    if (perRoundTrip == 0) {
+                        connections[thread]->request("POST", "/device/cat" + to_string(pickDevice(random)) +
+                                                             "/settings/add/weight/4.2");
+                        return;
+                    }
+                    string batch;
+                    for (int i = 0; i < perRoundTrip; i++)
+                        batch += frames[pickDevice(random)];
+                    connections[thread]->exchange(batch, perRoundTrip);
+                }, max(perRoundTrip, 1));
+            }
+        }
+        endpoint.stop();
+    }
+
+    // Thread-per-core against one endpoint shared by all the threads, for every core count: first the
+    // handlers' work with one pinned thread per core (on the devices of its core, or on all of them in the
+    // shared endpoint), then HTTP over loopback with ClientsPerCore connections per core, where the requests
+    // for the devices of another core are forwarded to it
+    void cores() {
+        const int ClientsPerCore = 2;
+        const string weight = "4.2";
+        int all = static_cast<int>(CatAwayCores::allowedCpus(CPU_SETSIZE).size());
+        vector<int> counts;
+        if (options.cores.empty())
+            for (int count = 1; count < all; count *= 2)
+                counts.push_back(count);
+        for (int count : options.cores)
+            counts.push_back(min(count, all));
+        counts.push_back(options.cores.empty() ? all : counts.back());
+        counts.erase(unique(counts.begin(), counts.end()), counts.end());
+        Address addr(Ipv4::loopback(), Port(options.port));
+
+        for (bool perCore : {false, true}) {
+            printHeader(perCore ? "inproc, one endpoint per core" : "inproc, one shared endpoint", options.reads, "cores");
+            for (int count : counts) {
+                vector<int> cpus = CatAwayCores::allowedCpus(count);
+                vector<CatAwayEndpoint*> endpoints;
+                unique_ptr<CatAwayCores> server;
+                unique_ptr<CatAwayEndpoint> shared;
+                if (perCore) {
+                    server = make_unique<CatAwayCores>(addr, count, options.dataDir);
+                    for (auto& endpoint : server->endpoints)
+                        endpoints.push_back(endpoint.get());
+                } else {
+                    shared = make_unique<CatAwayEndpoint>(addr, options.dataDir);
+                    endpoints.push_back(shared.get());
+                }
+                vector<vector<string>> owned(endpoints.size());
+                for (int i = 0; i < options.devices; i++) {
+                    string id = "cat" + to_string(i);
+                    owned[CatAwayEndpoint::partitionOf(id, endpoints.size())].push_back(id);
+                }
+                for (size_t core = 0; core < endpoints.size(); core++)
+                    populate(*endpoints[core], owned[core]);
+                run(static_cast<int>(cpus.size()), [&](int thread, std::mt19937& random) {
+                    size_t core = perCore ? thread : 0;
+                    uniform_int_distribution<size_t> pickDevice(0, owned[core].size() - 1);
+                    uniform_int_distribution<int> pickOp(0, 99);
+                    settingsRequest(*endpoints[core], owned[core][pickDevice(random)], pickOp(random) < options.reads, weight);
+                }, 1, &cpus);
+            }
+        }
+
+        for (bool perCore : {false, true}) {
+            printHeader(string(perCore ? "loopback, one endpoint per core" : "loopback, one shared endpoint") + ", " +
+                        to_string(ClientsPerCore) + " connections per core", options.reads, "cores");
+            for (int count : counts) {
+                unique_ptr<CatAwayCores> server;
+                unique_ptr<CatAwayEndpoint> shared;
+                if (perCore) {
+                    server = make_unique<CatAwayCores>(addr, count, options.dataDir);
+                    populate(*server);
+                    server->start();
+                } else {
+                    shared = make_unique<CatAwayEndpoint>(addr, options.dataDir);
+                    populate(*shared);
+                    shared->init(count, true);
+                    shared->start();
+                }
+                vector<unique_ptr<Connection>> connections;
+                for (int i = 0; i < count * ClientsPerCore; i++)
+                    connections.push_back(make_unique<Connection>(options.port));
+                run(count * ClientsPerCore, [&](int thread, std::mt19937& random) {
+                    uniform_int_distribution<int> pickDevice(0, options.devices - 1), pickOp(0, 99);
+                    string device = "/device/cat" + to_string(pickDevice(random));
+                    if (pickOp(random) < options.reads)
+                        connections[thread]->request("GET", device + "/settings/weight");
+                    else
+                        connections[thread]->request("POST", device + "/settings/add/weight/4.2");
+                }, 1, nullptr, count);
+                connections.clear();
+                if (perCore)
+                    server->stop();
+                else
+                    shared->stop();
+            }
+        }
+    }
+
+private:
+    // What GET /settings/weight (read) or POST /settings/add/weight (write) does for a device, without HTTP
+    static void settingsRequest(CatAwayEndpoint& endpoint, const string& id, bool read, const string& weight) {
+        if (read) {
+            CatAwayEndpoint::Device* device = endpoint.devices.find(id);
+            if (device == nullptr)
+                return;
+            Rcu::ReadSection section;
+            string body = "weight is " + device->settings.read(section)->get(Setting::Weight);
+            return;
+        }
+        CatAwayEndpoint::Device& device = endpoint.devices.get(id);
+        uint64_t lsn;
+        {
+            CatAwayEndpoint::MeasuredGuard guard(device.lock);
+            device.cat.set(Setting::Weight, weight);
+            lsn = endpoint.logDevice(device);
+            endpoint.deviceChanged(device);
+        }
+        endpoint.wal.waitDurable(lsn);
+    }
+
+    // A frame of input buffer 1 with only its first token, the weight, as a dispenser sends it
+    static string weightFrame(const string& id, uint32_t hundredths) {
+        size_t size = Telemetry::HeaderSize + id.size() + 4;
+        string frame = {static_cast<char>(size & 0xff), static_cast<char>(size >> 8), 1, static_cast<char>(id.size()), 1, 0};
+        frame += id;
+        for (int i = 0; i < 4; i++)
+            frame += static_cast<char>(hundredths >> (8 * i));
+        return frame;
+    }
+
+    template<typename Call>
+    void measureCalls(const char* name, Call call) {
+        const int Batch = 256;
+        Latencies latencies;
+        auto start = chrono::steady_clock::now();
+        auto end = start + chrono::duration<double>(options.seconds / 4);
+        while (chrono::steady_clock::now() < end) {
+            auto batchStart = chrono::steady_clock::now();
+            for (int i = 0; i < Batch; i++)
+                call();
+            auto batchTime = chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now() - batchStart).count();
+            latencies.histogram.record(batchTime / Batch);
+        }
+        double perCall = static_cast<double>(latencies.histogram.sum) / latencies.histogram.count;
+        printf("%-28s %10.1f %10llu %10llu\n", name, perCall,
+               static_cast<unsigned long long>(latencies.percentile(0.5)),
+               static_cast<unsigned long long>(latencies.percentile(0.99)));
+    }
+
+    // One profile per device, with a few dozen schedules shared by the fleet
+    void fillCats(CatRegistry& cats) {
+        static const char* speeds[] = {"slow", "medium", "fast"};
+        std::mt19937 random(1);
+        vector<string> schedules;
+        for (int i = 0; i < 40; i++)
+            schedules.push_back("0" + to_string(6 + i % 4) + ":00-1" + to_string(i % 10) + ":00-19:" + to_string(10 + i) + "-");
+        for (int i = 0; i < options.devices; i++) {
+            Cat cat;
+            cat.name = "cat" + to_string(i);
+            cat.age = 1 + i % 15;
+            cat.weight = 3 + (i % 40) / 10.0f;
+            cat.eatingSpeed = speeds[i % 3];
+            cat.feedingSchedule = schedules[random() % schedules.size()];
+            cat.recFoodG = recommendedFoodG(cat.age, cat.weight);
+            cat.nrBreaks = i % 3;
+            cats.save(cat, i + 1);
+        }
+    }
+
+    // Every device is written once beforehand, so the reads find them
+    void populate(CatAwayEndpoint& endpoint) {
+        for (int i = 0; i < options.devices; i++)
+            populate(endpoint, "cat" + to_string(i));
+    }
+
+    void populate(CatAwayEndpoint& endpoint, const vector<string>& ids) {
+        for (const string& id : ids)
+            populate(endpoint, id);
+    }
+
+    // Each device on the core owning it
+    void populate(CatAwayCores& cores) {
+        for (int i = 0; i < options.devices; i++) {
+            string id = "cat" + to_string(i);
+            populate(*cores.endpoints[CatAwayEndpoint::partitionOf(id, cores.size())], id);
+        }
+    }
+
+    static void populate(CatAwayEndpoint& endpoint, const string& id) {
+        CatAwayEndpoint::Device& device = endpoint.devices.get(id);
+        CatAwayEndpoint::Guard guard(device.lock);
+        device.cat.set(Setting::Weight, "4.2");
+    }
+
+    void printHeader(const string& mode, int reads, const char* unit = "threads") {
+        printf("%s: %d%% reads, %d devices\n", mode.c_str(), reads, options.devices);
+        printf("%8s %12s %10s %10s %10s\n", unit, "ops/s", "p50 us", "p99 us", "p999 us");
+    }
+
+    // Runs op on the given number of threads for the configured time and prints the results; an op may
+    // stand for several writes (the throughput is in writes, the latencies are per op).
+    // With cpus, thread t is pinned to cpus[t]. The row is labeled with the thread count, or with label.
+    template<typename Op>
+    void run(int threads, Op op, int writesPerOp = 1, const vector<int>* cpus = nullptr, int label = -1) {
+        vector<Latencies> perThread(threads);
+        atomic<bool> done{false};
+        vector<thread> workers;
+        for (int t = 0; t < threads; t++) {
+            workers.emplace_back([&, t] {
+                if (cpus != nullptr) {
+                    cpu_set_t pinned;
+                    CPU_ZERO(&pinned);
+                    CPU_SET((*cpus)[t], &pinned);
+                    pthread_setaffinity_np(pthread_self(), sizeof(pinned), &pinned);
+                }
+                std::mt19937 random(t + 1);
+                Latencies& latencies = perThread[t];
+                while (!done.load(memory_order_relaxed)) {
+                    auto start = chrono::steady_clock::now();
+                    op(t, random);
+                    latencies.histogram.record(
+                        chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now() - start).count());
+                }
+            });
+        }
+        this_thread::sleep_for(chrono::duration<double>(options.seconds));
+        done = true;
+        for (auto& worker : workers)
+            worker.join();
+
+        Latencies total;
+        for (const auto& latencies : perThread)
+            total.add(latencies);
+        printf("%8d %12.0f %10.1f %10.1f %10.1f\n", label < 0 ? threads : label, total.histogram.count * writesPerOp / options.seconds,
+               total.percentile(0.5) / 1e3, total.percentile(0.99) / 1e3, total.percentile(0.999) / 1e3);
+    }
+
+    Options options;
+};
+
+int main(int argc, char* argv[]) {
+    if (argc < 2) {
+        fprintf(stderr, "usage: %s micro|inproc|loopback|telemetry|cores [--threads 1,2,4] [--seconds s] [--reads %%] [--devices n]"
+                        " [--server-threads n] [--port p] [--data-dir dir] [--cores 1,2,4]\n", argv[0]);
+        return 1;
+    }
+
+    CatAwayBench::Options options;
+    for (int i = 2; i + 1 < argc; i += 2) {
+        string option = argv[i], value = argv[i + 1];
+        if (option == "--threads" || option == "--cores") {
+            vector<int>& counts = option == "--threads" ? options.threads : options.cores;
+            counts.clear();
+            for (size_t start = 0; start < value.size();) {
+                size_t comma = value.find(',', start);
+                if (comma == string::npos)
+                    comma = value.size();
+                counts.push_back(stoi(value.substr(start, comma - start)));
+                start = comma + 1;
+            }
+        } else if (option == "--seconds")
+            options.seconds = stod(value);
+        else if (option == "--reads")
+            options.reads = stoi(value);
+        else if (option == "--devices")
+            options.devices = stoi(value);
+        else if (option == "--server-threads")
+            options.serverThreads = stoi(value);
+        else if (option == "--port")
+            options.port = static_cast<uint16_t>(stoi(value));
+        else if (option == "--data-dir")
+            options.dataDir = value;
+        else {
+            fprintf(stderr, "unknown option %s\n", option.c_str());
+            return 1;
+        }
+    }
+
+    CatAwayBench bench(options);
+    string mode = argv[1];
+    if (mode == "micro")
+        bench.micro();
+    else if (mode == "inproc")
+        bench.inproc();
+    else if (mode == "loopback")
+        bench.loopback();
+    else if (mode == "telemetry")
+        bench.telemetry();
+    else if (mode == "cores")
+        bench.cores();
+    else {
+        fprintf(stderr, "unknown mode %s\n", mode.c_str());
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,128 @@
+#pragma once
+
+#include <atomic>
+#include <cerrno>
+#include <cstddef>
+#include <cstdint>
+#include <ctime>
+#include <semaphore.h>
+
+// Bounded multi-producer queue without locks (Dmitry Vyukov's ring of sequenced cells).
+// push() never blocks: when the ring is full the element is refused.
+// The consumer sleeps in pop() on a semaphore counting the elements, so an idle consumer costs no CPU
+// and a push wakes it up right away.
+template<typename T, size_t Capacity>
+class BoundedQueue {
+    static_assert(Capacity >= 2 && (Capacity & (Capacity - 1)) == 0, "the capacity must be a power of 2");
+
+public:
+    BoundedQueue() {
+        for (size_t i = 0; i < Capacity; i++)
+            cells[i].sequence.store(i, std::memory_order_relaxed);
+        sem_init(&items, 0, 0);
+    }
+
+    ~BoundedQueue() {
+        sem_destroy(&items);
+    }
+
+    BoundedQueue(const BoundedQueue&) = delete;
+    BoundedQueue& operator=(const BoundedQueue&) = delete;
+
+    // Returns false (and drops the element) if the queue is full
+    bool push(const T& value) {
+        Cell* cell;
+        size_t pos = enqueuePos.load(std::memory_order_relaxed);
+        while (true) {
+            cell = &cells[pos & (Capacity - 1)];
+            size_t sequence = cell->sequence.load(std::memory_order_acquire);
+            intptr_t diff = (intptr_t)sequence - (intptr_t)pos;
+            if (diff == 0) {
+                if (enqueuePos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+                    break;
+            }
+            else if (diff < 0) {
+                return false;
+            }
+            else {
+                pos = enqueuePos.load(std::memory_order_relaxed);
+            }
+        }
+        cell->data = value;
+        cell->sequence.store(pos + 1, std::memory_order_release);
+        sem_post(&items);
+        return true;
+    }
+
+    // Waits until there is an element
+    T pop() {
+        while (sem_wait(&items) != 0)
+            ;           // interrupted by a signal
+        T value;
+        while (!dequeue(value))
+            ;           // only spins while an earlier producer is still writing its cell
+        return value;
+    }
+
+    // Waits at most the given number of milliseconds; returns false if nothing came
+    bool pop(T& value, long timeoutMs) {
+        timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_sec += timeoutMs / 1000;
+        deadline.tv_nsec += (timeoutMs % 1000) * 1000000;
+        if (deadline.tv_nsec >= 1000000000) {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000;
+        }
+        while (sem_timedwait(&items, &deadline) != 0) {
+            if (errno != EINTR)
+                return false;
+        }
+        while (!dequeue(value))
+            ;
+        return true;
+    }
+
+    // Returns false right away if the queue is empty
+    bool tryPop(T& value) {
+        if (sem_trywait(&items) != 0)
+            return false;
+        while (!dequeue(value))
+            ;
+        return true;
+    }
+
+private:
+    struct Cell {
+        std::atomic<size_t> sequence;
+        T data;
+    };
+
+    bool dequeue(T& value) {
+        Cell* cell;
+        size_t pos = dequeuePos.load(std::memory_order_relaxed);
+        while (true) {
+            cell = &cells[pos & (Capacity - 1)];
+            size_t sequence = cell->sequence.load(std::memory_order_acquire);
+            intptr_t diff = (intptr_t)sequence - (intptr_t)(pos + 1);
+            if (diff == 0) {
+                if (dequeuePos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+                    break;
+            }
+            else if (diff < 0) {
+                return false;
+            }
+            else {
+                pos = dequeuePos.load(std::memory_order_relaxed);
+            }
+        }
+        value = cell->data;
+        cell->sequence.store(pos + Capacity, std::memory_order_release);
+        return true;
+    }
+
+    Cell cells[Capacity];
+    alignas(64) std::atomic<size_t> enqueuePos{0};
+    alignas(64) std::atomic<size_t> dequeuePos{0};
+    sem_t items;
+};
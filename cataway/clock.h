@@ -0,0 +1,61 @@
+#pragma once
+
+#include <atomic>
+#include <ctime>
+
+// Wall clock shared by the request handlers.
+// Reading it costs a vDSO call (CLOCK_REALTIME_COARSE, one tick of resolution) and an addition:
+// the offset to the dispenser's time (UTC + 3 ore, ora Romaniei) is worked out once, at construction,
+// instead of a gmtime/mktime pair on every consumption event.
+// A manual clock only moves when it is set, so simulations can run faster than real time.
+class Clock {
+public:
+    enum Mode { System, Manual };
+
+    explicit Clock(Mode mode = System)
+        : Clock(mode, ::time(nullptr)) {}
+
+    // A manual clock starting at the given time: its offset does not depend on when it is made
+    Clock(Mode mode, time_t start)
+        : mode(mode)
+    {
+        tm utc;
+        gmtime_r(&start, &utc);
+        utc.tm_hour += 3;
+        offset = mktime(&utc) - start;
+        current.store(start, std::memory_order_relaxed);
+    }
+
+    // Seconds since the epoch, like ::time()
+    time_t time() const {
+        if (mode == Manual)
+            return current.load(std::memory_order_relaxed);
+        timespec now;
+        clock_gettime(CLOCK_REALTIME_COARSE, &now);
+        return now.tv_sec;
+    }
+
+    // The dispenser's time, in which refills and refreshments are predicted
+    time_t romaniaTime() const {
+        return time() + offset;
+    }
+
+    // The time() of a moment given in the dispenser's time
+    time_t fromRomaniaTime(time_t romaniaTime) const {
+        return romaniaTime - offset;
+    }
+
+    // Only for manual clocks
+    void set(time_t now) {
+        current.store(now, std::memory_order_relaxed);
+    }
+
+    void advance(time_t seconds) {
+        current.fetch_add(seconds, std::memory_order_relaxed);
+    }
+
+private:
+    Mode mode;
+    time_t offset;
+    std::atomic<time_t> current;
+};
@@ -0,0 +1,147 @@
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <ctime>
+
+// Consumption history of one tank (food in g or water in ml) of one dispenser.
+// The last RawSamples readings are kept as they came; on top of them, every reading is added right away
+// to a minute, an hour and a day rollup, each a fixed ring of buckets. The memory is fixed (sizeof),
+// whatever the number of readings: older buckets are overwritten by newer ones.
+// A range query adds whole buckets, the coarsest that fit, so it never goes through the raw readings.
+class ConsumptionHistory {
+public:
+    struct Sample {
+        uint32_t time;
+        int32_t amount;
+    };
+
+    struct Totals {
+        uint64_t count = 0;
+        uint64_t total = 0;
+        uint32_t max = 0;
+    };
+
+    static const size_t RawSamples = 256;
+    static constexpr time_t MaxTime = UINT32_MAX;     // times are kept as u32 unix times: [0, MaxTime]
+
+    // Readings at times outside [0, MaxTime] are not kept
+    void record(time_t time, int amount) {
+        if (time < 0 || time > MaxTime)
+            return;
+        raw[rawNext++ % RawSamples] = {static_cast<uint32_t>(time), amount};
+        for (int level = 0; level < NrLevels; level++)
+            add(level, time, amount);
+    }
+
+    // Totals of the readings in [from, to). The range is answered with minute resolution, so from and to are
+    // widened to minutes; where only hour or day buckets are left (older data) they are widened to those.
+    Totals query(time_t& from, time_t& to) const {
+        Totals totals;
+        from = std::min(std::max<time_t>(from, 0), MaxTime);
+        to = std::min(std::max<time_t>(to, 0), MaxTime);
+        from -= from % Levels[0].width;
+        to += (Levels[0].width - to % Levels[0].width) % Levels[0].width;
+
+        // nothing was recorded after the newest day bucket
+        time_t end = std::min<time_t>(to, static_cast<time_t>(newest[NrLevels - 1] + 1) * Levels[NrLevels - 1].width);
+        time_t t = from;
+        while (t < end) {
+            int level = NrLevels - 1;
+            for (; level >= 0; level--) {
+                time_t width = Levels[level].width;
+                if (t % width == 0 && t + width <= to && retains(level, t / width))
+                    break;
+            }
+            if (level < 0) {
+                // the finest level that fits does not go back this far: use the finest one that does
+                for (level = 0; level < NrLevels && !retains(level, t / Levels[level].width); level++)
+                    ;
+                if (level == NrLevels) {
+                    // older than everything kept: there is nothing to add until the oldest day bucket
+                    t = oldest(NrLevels - 1);
+                    continue;
+                }
+                time_t width = Levels[level].width;
+                from = std::min(from, t - t % width);
+                t -= t % width;
+                to = std::max(to, t + width);
+            }
+            addTo(totals, level, t / Levels[level].width);
+            t += Levels[level].width;
+        }
+        return totals;
+    }
+
+    // The most recent readings, oldest first
+    size_t recent(Sample* samples, size_t count) const {
+        size_t available = std::min<size_t>(rawNext, RawSamples);
+        count = std::min(count, available);
+        for (size_t i = 0; i < count; i++)
+            samples[i] = raw[(rawNext - count + i) % RawSamples];
+        return count;
+    }
+
+    static constexpr size_t memoryBytes() {
+        return sizeof(ConsumptionHistory);
+    }
+
+private:
+    struct Bucket {
+        uint32_t slot;          // time / width; 0 while the bucket was never used
+        uint32_t count;
+        uint32_t max;
+        uint64_t total;         // amounts go up to INT32_MAX
+    };
+
+    struct Level {
+        uint32_t width;         // seconds
+        uint32_t size;          // buckets
+        uint32_t offset;        // in buckets[]
+    };
+
+    static const int NrLevels = 3;
+    static constexpr Level Levels[NrLevels] = {
+        {60, 120, 0},           // the last 2 hours, by minute
+        {3600, 168, 120},       // the last 7 days, by hour
+        {86400, 366, 288},      // the last year, by day (UTC)
+    };
+    static const size_t NrBuckets = 120 + 168 + 366;
+
+    void add(int level, time_t time, int amount) {
+        uint32_t slot = static_cast<uint32_t>(time / Levels[level].width);
+        if (slot + Levels[level].size <= newest[level])
+            return;             // older than this level keeps
+        Bucket& bucket = buckets[Levels[level].offset + slot % Levels[level].size];
+        if (bucket.slot != slot)
+            bucket = {slot, 0, 0, 0};
+        bucket.count++;
+        bucket.total += amount;
+        bucket.max = std::max<uint32_t>(bucket.max, amount);
+        newest[level] = std::max(newest[level], slot);
+    }
+
+    bool retains(int level, time_t slot) const {
+        return slot + Levels[level].size > newest[level];
+    }
+
+    time_t oldest(int level) const {
+        uint32_t slot = newest[level] >= Levels[level].size ? newest[level] - Levels[level].size + 1 : 0;
+        return static_cast<time_t>(slot) * Levels[level].width;
+    }
+
+    void addTo(Totals& totals, int level, time_t slot) const {
+        const Bucket& bucket = buckets[Levels[level].offset + slot % Levels[level].size];
+        if (bucket.slot != slot)
+            return;             // no readings in this bucket
+        totals.count += bucket.count;
+        totals.total += bucket.total;
+        totals.max = std::max(totals.max, bucket.max);
+    }
+
+    Sample raw[RawSamples] = {};
+    uint64_t rawNext = 0;
+    Bucket buckets[NrBuckets] = {};
+    uint32_t newest[NrLevels] = {};
+};
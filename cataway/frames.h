@@ -0,0 +1,62 @@
+// Generated by gen_validators.py from buffers.json, do not edit: run python3 gen_validators.py
+#pragma once
+
+#include <cstdint>
+
+#include "validators.h"
+
+namespace Frames {
+
+// Integer and Hundredths are little-endian u32 (the value, or the value * 100); Flag is one byte, 0 or 1;
+// Text is padded with zero bytes up to the size
+enum class Encoding : uint8_t {
+    Integer,
+    Hundredths,
+    Flag,
+    Text,
+};
+
+struct Field {
+    const char* setting;
+    Encoding encoding;
+    uint8_t size;
+    const Validators::Dfa* validator;
+};
+
+// The tokens of an input buffer are fields[first, first + count)
+struct Layout {
+    uint8_t first;
+    uint8_t count;
+};
+
+inline constexpr Field fields[] = {
+    {"weight", Encoding::Hundredths, 4, &Validators::weight},
+    {"age", Encoding::Hundredths, 4, &Validators::age},
+    {"eatingSpeed", Encoding::Text, 10, &Validators::eatingSpeed},
+    {"breakDuration", Encoding::Integer, 4, &Validators::breakDuration},
+    {"feedingSchedule", Encoding::Text, 50, &Validators::feedingSchedule},
+    {"waterBowlCapacityMl", Encoding::Integer, 4, &Validators::waterBowlCapacityMl},
+    {"waterLastRefreshed", Encoding::Text, 30, &Validators::waterLastRefreshed},
+    {"waterRefSchedule", Encoding::Text, 50, &Validators::waterRefSchedule},
+    {"foodExpDate", Encoding::Text, 30, &Validators::foodExpDate},
+    {"emptyFoodTank", Encoding::Flag, 1, &Validators::emptyFoodTank},
+    {"emptyWaterTank", Encoding::Flag, 1, &Validators::emptyWaterTank},
+    {"lastConsumedFood", Encoding::Integer, 4, &Validators::lastConsumedFood},
+    {"lastConsumedWater", Encoding::Integer, 4, &Validators::lastConsumedWater},
+    {"foodIsRefilled", Encoding::Flag, 1, &Validators::foodIsRefilled},
+    {"waterIsRefilled", Encoding::Flag, 1, &Validators::waterIsRefilled},
+    {"waterIsRefreshed", Encoding::Flag, 1, &Validators::waterIsRefreshed},
+};
+
+// By the number of the input buffer; 0 is not a buffer
+inline constexpr Layout layouts[] = {
+    {0, 0},
+    {0, 5},
+    {5, 3},
+    {8, 3},
+    {11, 5},
+};
+
+inline constexpr int NrBuffers = 4;
+
+}
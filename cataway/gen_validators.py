@@ -0,0 +1,410 @@
+#!/usr/bin/env python3
+# Builds validators.h from buffers.json: every input token with a "setting" gets a DFA, built here from its
+# regex-rule, that main.cpp runs over the value instead of parsing it blindly.
+# It also builds frames.h, the layout of the binary telemetry frames: the same tokens, packed at their sizes.
+#
+#   python3 gen_validators.py [--check] [buffers.json] [validators.h] [frames.h]
+#
+# It runs before every compile (see the README). With --check nothing is written: it fails when the
+# headers differ from what buffers.json generates, so a hand edit or a forgotten run is caught.
+#
+# The rules may use literals, ., [classes] with ranges, \d, groups, |, ?, *, + and {n}, {n,}, {n,m};
+# ^ and $ are implied (a value matches as a whole).
+
+import json
+import sys
+
+MAX_STATES = 64         # the accepting states are one 64-bit mask
+
+
+def parse(rule):
+    """The rule as a tree of ('set', bytes), ('cat', [..]), ('alt', [..]), ('star', n), ('opt', n)."""
+    text = rule[1:] if rule.startswith('^') else rule
+    if text.endswith('$') and not text.endswith('\\$'):
+        text = text[:-1]
+    pos = 0
+
+    def peek():
+        return text[pos] if pos < len(text) else None
+
+    def take():
+        nonlocal pos
+        pos += 1
+        return text[pos - 1]
+
+    def skip(to):
+        nonlocal pos
+        pos = to
+
+    def escape():
+        c = take()
+        if c == 'd':
+            return set(range(ord('0'), ord('9') + 1))
+        return {ord(c)}
+
+    def char_class():
+        negate = peek() == '^'
+        if negate:
+            take()
+        chars = set()
+        first = True
+        while first or peek() != ']':
+            first = False
+            c = take()
+            if c == '\\':
+                low = escape()
+            else:
+                low = {ord(c)}
+            if peek() == '-' and pos + 1 < len(text) and text[pos + 1] != ']' and len(low) == 1:
+                take()
+                high = take()
+                if high == '\\':
+                    high = chr(min(escape()))
+                chars |= set(range(min(low), ord(high) + 1))
+            else:
+                chars |= low
+        take()
+        return set(range(256)) - chars if negate else chars
+
+    def atom():
+        c = take()
+        if c == '(':
+            node = alternation()
+            if take() != ')':
+                raise ValueError('unbalanced ( in ' + rule)
+            return node
+        if c == '[':
+            return ('set', frozenset(char_class()))
+        if c == '\\':
+            return ('set', frozenset(escape()))
+        if c == '.':
+            return ('set', frozenset(set(range(256)) - {ord('\n')}))
+        return ('set', frozenset({ord(c)}))
+
+    def repeat(node, low, high):
+        parts = [node] * low
+        if high is None:
+            parts.append(('star', node))
+        else:
+            parts += [('opt', node)] * (high - low)
+        return ('cat', parts)
+
+    def quantified():
+        node = atom()
+        while peek() in ('?', '*', '+', '{'):
+            c = take()
+            if c == '?':
+                node = ('opt', node)
+            elif c == '*':
+                node = ('star', node)
+            elif c == '+':
+                node = ('cat', [node, ('star', node)])
+            else:
+                end = text.index('}', pos)
+                bounds = text[pos:end].split(',')
+                skip(end + 1)
+                low = int(bounds[0])
+                high = low if len(bounds) == 1 else (int(bounds[1]) if bounds[1] else None)
+                node = repeat(node, low, high)
+        return node
+
+    def sequence():
+        parts = []
+        while peek() is not None and peek() not in ('|', ')'):
+            parts.append(quantified())
+        return ('cat', parts)
+
+    def alternation():
+        options = [sequence()]
+        while peek() == '|':
+            take()
+            options.append(sequence())
+        return options[0] if len(options) == 1 else ('alt', options)
+
+    tree = alternation()
+    if pos != len(text):
+        raise ValueError('unexpected %r in %s' % (text[pos], rule))
+    return tree
+
+
+class Nfa:
+    """Thompson construction: edges[state] is a list of (bytes or None for epsilon, target)."""
+
+    def __init__(self):
+        self.edges = []
+
+    def state(self):
+        self.edges.append([])
+        return len(self.edges) - 1
+
+    def build(self, node):
+        """Returns (start, end) of the fragment."""
+        kind = node[0]
+        start = self.state()
+        end = self.state()
+        if kind == 'set':
+            self.edges[start].append((node[1], end))
+        elif kind == 'cat':
+            current = start
+            for part in node[1]:
+                s, e = self.build(part)
+                self.edges[current].append((None, s))
+                current = e
+            self.edges[current].append((None, end))
+        elif kind == 'alt':
+            for option in node[1]:
+                s, e = self.build(option)
+                self.edges[start].append((None, s))
+                self.edges[e].append((None, end))
+        elif kind in ('star', 'opt'):
+            s, e = self.build(node[1])
+            self.edges[start].append((None, s))
+            self.edges[start].append((None, end))
+            self.edges[e].append((None, end))
+            if kind == 'star':
+                self.edges[e].append((None, s))
+        return start, end
+
+    def closure(self, states):
+        stack = list(states)
+        seen = set(states)
+        while stack:
+            for chars, target in self.edges[stack.pop()]:
+                if chars is None and target not in seen:
+                    seen.add(target)
+                    stack.append(target)
+        return frozenset(seen)
+
+
+def compile_rule(rule):
+    """Returns (class of every byte, number of classes, transitions, accepting states) of the minimal DFA.
+    State 0 is the dead state and state 1 the start."""
+    nfa = Nfa()
+    start, end = nfa.build(parse(rule))
+
+    # bytes that no edge tells apart share a class
+    signature = {}
+    for byte in range(256):
+        key = tuple(i for i, edges in enumerate(nfa.edges)
+                    for chars, _ in edges if chars is not None and byte in chars)
+        signature.setdefault(key, []).append(byte)
+    groups = sorted(signature.values(), key=lambda bytes_: bytes_[0])
+    class_of = [0] * 256
+    for index, bytes_ in enumerate(groups):
+        for byte in bytes_:
+            class_of[byte] = index
+
+    # subset construction
+    dead = frozenset()
+    first = nfa.closure({start})
+    subsets = [dead, first]
+    index = {dead: 0, first: 1}
+    transitions = []
+    i = 0
+    while i < len(subsets):
+        row = []
+        for bytes_ in groups:
+            byte = bytes_[0]
+            moved = {target for s in subsets[i] for chars, target in nfa.edges[s] if chars is not None and byte in chars}
+            target = nfa.closure(moved) if moved else dead
+            if target not in index:
+                index[target] = len(subsets)
+                subsets.append(target)
+            row.append(index[target])
+        transitions.append(row)
+        i += 1
+    accepting = {i for i, subset in enumerate(subsets) if end in subset}
+
+    # Moore minimization, keeping the dead state 0 and the start 1 in front
+    partition = [1 if s in accepting else 0 for s in range(len(subsets))]
+    while True:
+        keys = [(partition[s], tuple(partition[t] for t in transitions[s])) for s in range(len(subsets))]
+        numbers = {}
+        for s in (0, 1):
+            numbers.setdefault(keys[s], len(numbers))
+        for s in range(len(subsets)):
+            numbers.setdefault(keys[s], len(numbers))
+        refined = [numbers[keys[s]] for s in range(len(subsets))]
+        if len(set(refined)) == len(set(partition)):
+            partition = refined
+            break
+        partition = refined
+    if partition[1] == 0:
+        raise ValueError(rule + ' matches nothing')
+    count = max(partition) + 1
+    table = [[0] * len(groups) for _ in range(count)]
+    final = set()
+    for s in range(len(subsets)):
+        table[partition[s]] = [partition[t] for t in transitions[s]]
+        if s in accepting:
+            final.add(partition[s])
+    if count > MAX_STATES:
+        raise ValueError('%s needs %d states, more than %d' % (rule, count, MAX_STATES))
+    return class_of, len(groups), table, final
+
+
+def max_length(token):
+    # a 4 byte number has at most 9 digits, so it always fits an int or the precision of a float
+    if token['token-type'] == 'number' and token['byte-size'] == 4:
+        return 9
+    return token['byte-size']
+
+
+def cpp_string(text):
+    return '"' + text.replace('\\', '\\\\').replace('"', '\\"') + '"'
+
+
+def generate(buffers):
+    out = ['// Generated by gen_validators.py from buffers.json, do not edit: run python3 gen_validators.py',
+           '#pragma once',
+           '',
+           '#include <cstddef>',
+           '#include <cstdint>',
+           '#include <string_view>',
+           '',
+           'namespace Validators {',
+           '',
+           '// A regex-rule of buffers.json, as a DFA over classes of bytes: state 0 is dead, state 1 is the start',
+           'struct Dfa {',
+           '    const char* rule;',
+           '    size_t maxLength;',
+           '    size_t nrClasses;',
+           '    const uint8_t* classOf;     // 256 entries',
+           '    const uint8_t* next;        // [state * nrClasses + class]',
+           '    uint64_t accepting;         // one bit per state',
+           '};',
+           '',
+           '// One table lookup per byte, no allocation, no exception',
+           'inline bool matches(const Dfa& dfa, std::string_view value) {',
+           '    if (value.size() > dfa.maxLength)',
+           '        return false;',
+           '    unsigned state = 1;',
+           '    for (unsigned char c : value)',
+           '        state = dfa.next[state * dfa.nrClasses + dfa.classOf[c]];',
+           '    return (dfa.accepting >> state) & 1;',
+           '}',
+           '']
+    for buffer in buffers['input-buffers'].values():
+        for token in buffer['buffer-tokens']:
+            if 'setting' not in token:
+                continue
+            name = token['setting']
+            class_of, classes, table, final = compile_rule(token['regex-rule'])
+            out.append('// %s: %s' % (token['name'], token['description']))
+            out.append('inline constexpr uint8_t %sClasses[256] = {' % name)
+            for row in range(0, 256, 32):
+                out.append('    ' + ', '.join(str(c) for c in class_of[row:row + 32]) + ',')
+            out.append('};')
+            out.append('inline constexpr uint8_t %sNext[%d] = {' % (name, len(table) * classes))
+            for row in table:
+                out.append('    ' + ', '.join(str(t) for t in row) + ',')
+            out.append('};')
+            mask = sum(1 << s for s in final)
+            out.append('inline constexpr Dfa %s = {%s, %d, %d, %sClasses, %sNext, 0x%xull};' %
+                       (name, cpp_string(token['regex-rule']), max_length(token), classes, name, name, mask))
+            out.append('')
+    out.append('}')
+    return '\n'.join(out) + '\n'
+
+
+def encoding(token):
+    """How the token travels in a binary frame, and its size there"""
+    if token['token-type'] == 'bool':
+        return 'Flag', 1            # the byte-size is that of "false"; the frame has one byte, 0 or 1
+    if token['token-type'] == 'number':
+        if token['byte-size'] != 4:
+            raise ValueError(token['setting'] + ': numbers travel as 4 bytes')
+        return ('Hundredths' if '\\.' in token['regex-rule'] else 'Integer'), 4
+    return 'Text', token['byte-size']
+
+
+def generate_frames(buffers):
+    out = ['// Generated by gen_validators.py from buffers.json, do not edit: run python3 gen_validators.py',
+           '#pragma once',
+           '',
+           '#include <cstdint>',
+           '',
+           '#include "validators.h"',
+           '',
+           'namespace Frames {',
+           '',
+           '// Integer and Hundredths are little-endian u32 (the value, or the value * 100); Flag is one byte, 0 or 1;',
+           '// Text is padded with zero bytes up to the size',
+           'enum class Encoding : uint8_t {',
+           '    Integer,',
+           '    Hundredths,',
+           '    Flag,',
+           '    Text,',
+           '};',
+           '',
+           'struct Field {',
+           '    const char* setting;',
+           '    Encoding encoding;',
+           '    uint8_t size;',
+           '    const Validators::Dfa* validator;',
+           '};',
+           '',
+           '// The tokens of an input buffer are fields[first, first + count)',
+           'struct Layout {',
+           '    uint8_t first;',
+           '    uint8_t count;',
+           '};',
+           '',
+           'inline constexpr Field fields[] = {']
+    layouts = ['    {0, 0},']
+    count = 0
+    for number, buffer in sorted(buffers['input-buffers'].items(), key=lambda item: int(item[0])):
+        if int(number) != len(layouts):
+            raise ValueError('input buffers must be numbered 1, 2, ...')
+        first = count
+        for token in buffer['buffer-tokens']:
+            if 'setting' not in token:
+                continue
+            kind, size = encoding(token)
+            out.append('    {"%s", Encoding::%s, %d, &Validators::%s},' % (token['setting'], kind, size, token['setting']))
+            count += 1
+        if count - first > 16:
+            raise ValueError('buffer %s has more than 16 tokens' % number)
+        layouts.append('    {%d, %d},' % (first, count - first))
+    out.append('};')
+    out.append('')
+    out.append('// By the number of the input buffer; 0 is not a buffer')
+    out.append('inline constexpr Layout layouts[] = {')
+    out += layouts
+    out.append('};')
+    out.append('')
+    out.append('inline constexpr int NrBuffers = %d;' % (len(layouts) - 1))
+    out.append('')
+    out.append('}')
+    return '\n'.join(out) + '\n'
+
+
+def write_or_check(path, text, check):
+    """Writes the generated header; with check, only tells whether the one on disk is the same."""
+    if check:
+        try:
+            with open(path) as f:
+                current = f.read()
+        except FileNotFoundError:
+            current = None
+        if current != text:
+            print('%s is out of date with buffers.json: run python3 gen_validators.py' % path, file=sys.stderr)
+            return False
+        return True
+    with open(path, 'w') as f:
+        f.write(text)
+    return True
+
+
+if __name__ == '__main__':
+    args = sys.argv[1:]
+    check = '--check' in args
+    args = [arg for arg in args if arg != '--check']
+    source = args[0] if len(args) > 0 else 'buffers.json'
+    target = args[1] if len(args) > 1 else 'validators.h'
+    frames = args[2] if len(args) > 2 else 'frames.h'
+    with open(source) as f:
+        buffers = json.load(f)
+    ok = write_or_check(target, generate(buffers), check)
+    ok = write_or_check(frames, generate_frames(buffers), check) and ok
+    sys.exit(0 if ok else 1)
@@ -1,5 +1,11 @@
 
 #include <algorithm>
+#include <array>
+#include <deque>
+#include <memory>
+#include <shared_mutex>
+#include <string_view>
+#include <unordered_map>
 
 #include <pistache/net.h>
 #include <pistache/http.h>
@@ -13,14 +19,198 @@
 #include <mosquitto.h>
 
 #include <ctime>
+#include <netinet/in.h>
+#include <pthread.h>
+#include <sched.h>
 #include <signal.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+
+#include "alerts.h"
+#include "bounded_queue.h"
+#include "clock.h"
+#include "consumption_history.h"
+#include "metrics.h"
+#include "ndjson.h"
+#include "rcu.h"
+#include "wal.h"
+#include "seqlock.h"
+#include "telemetry.h"
+#include "timer_wheel.h"
+#include "validators.h"
 
 using namespace std;
 using namespace Pistache;
 
-float globalWeight;
-float globalAge;
-string globalEatingSpeed;
+// What the status feed (/status/:since) reports about a dispenser
+struct DispenserStatus {
+    uint64_t alerts = 0;                // AlertState word
+    int32_t foodG = 0;
+    int32_t waterMl = 0;
+};
+
+// What is published over MQTT about a dispenser (its state topic).
+// Written under the lock of the dispenser, read by the MQTT thread without stopping the writers.
+struct PublishedState {
+    float weight = -1;
+    float age = -1;
+    char eatingSpeed[16] = "";
+    DispenserStatus status;
+};
+
+// The settings of a CatAway, as named in the /settings and /currentQuantity routes
+enum class Setting {
+    Weight,
+    Age,
+    EatingSpeed,
+    FeedingSchedule,
+    WaterBowlCapacityMl,
+    WaterRefSchedule,
+    FoodExpDate,
+    EmptyFoodTank,
+    EmptyWaterTank,
+    RecFoodG,
+    NrBreaks,
+    CurrentQuantityWaterMl,
+    RefreshWater,
+    CurrentQuantityFoodG,
+    RefillFood,
+    NextFoodRefill,
+    NextWaterRefill,
+    LastConsumedWater,
+    LastConsumedFood,
+    TankSizeFoodG,
+    TankSizeWaterMl,
+    BreakDuration,
+    WaterLastRefreshed,
+    FoodIsRefilled,
+    WaterIsRefilled,
+    WaterIsRefreshed,
+    Unknown
+};
+
+// FNV-1a, evaluated at compile time for the case labels below
+constexpr uint32_t settingHash(string_view name) {
+    uint32_t hash = 2166136261u;
+    for (char c : name) {
+        hash ^= static_cast<unsigned char>(c);
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+// Resolves a route parameter to its setting with one hash and one compare, without allocating.
+// Two names with the same hash would be duplicate case labels, so the table is checked by the compiler.
+constexpr Setting settingFromName(string_view name) {
+    auto is = [name](string_view expected, Setting setting) {
+        return name == expected ? setting : Setting::Unknown;
+    };
+    switch (settingHash(name)) {
+        case settingHash("weight"):                 return is("weight", Setting::Weight);
+        case settingHash("age"):                    return is("age", Setting::Age);
+        case settingHash("eatingSpeed"):            return is("eatingSpeed", Setting::EatingSpeed);
+        case settingHash("feedingSchedule"):        return is("feedingSchedule", Setting::FeedingSchedule);
+        case settingHash("waterBowlWeightG"):       return is("waterBowlWeightG", Setting::WaterBowlCapacityMl);
+        case settingHash("waterBowlCapacityMl"):    return is("waterBowlCapacityMl", Setting::WaterBowlCapacityMl);
+        case settingHash("waterRefSchedule"):       return is("waterRefSchedule", Setting::WaterRefSchedule);
+        case settingHash("foodExpDate"):            return is("foodExpDate", Setting::FoodExpDate);
+        case settingHash("emptyFoodTank"):          return is("emptyFoodTank", Setting::EmptyFoodTank);
+        case settingHash("emptyWaterTank"):         return is("emptyWaterTank", Setting::EmptyWaterTank);
+        case settingHash("recFoodG"):               return is("recFoodG", Setting::RecFoodG);
+        case settingHash("nrBreaks"):               return is("nrBreaks", Setting::NrBreaks);
+        case settingHash("currentQuantityWaterMl"): return is("currentQuantityWaterMl", Setting::CurrentQuantityWaterMl);
+        case settingHash("water"):                  return is("water", Setting::CurrentQuantityWaterMl);
+        case settingHash("refreshWater"):           return is("refreshWater", Setting::RefreshWater);
+        case settingHash("currentQuantityFoodG"):   return is("currentQuantityFoodG", Setting::CurrentQuantityFoodG);
+        case settingHash("food"):                   return is("food", Setting::CurrentQuantityFoodG);
+        case settingHash("refillFood"):             return is("refillFood", Setting::RefillFood);
+        case settingHash("nextFoodRefill"):         return is("nextFoodRefill", Setting::NextFoodRefill);
+        case settingHash("nextWaterRefill"):        return is("nextWaterRefill", Setting::NextWaterRefill);
+        case settingHash("lastConsumedWater"):      return is("lastConsumedWater", Setting::LastConsumedWater);
+        case settingHash("lastConsumedFood"):       return is("lastConsumedFood", Setting::LastConsumedFood);
+        case settingHash("tankSizeFoodG"):          return is("tankSizeFoodG", Setting::TankSizeFoodG);
+        case settingHash("tankSizeWaterMl"):        return is("tankSizeWaterMl", Setting::TankSizeWaterMl);
+        case settingHash("breakDuration"):          return is("breakDuration", Setting::BreakDuration);
+        case settingHash("waterLastRefreshed"):     return is("waterLastRefreshed", Setting::WaterLastRefreshed);
+        case settingHash("foodIsRefilled"):         return is("foodIsRefilled", Setting::FoodIsRefilled);
+        case settingHash("waterIsRefilled"):        return is("waterIsRefilled", Setting::WaterIsRefilled);
+        case settingHash("waterIsRefreshed"):       return is("waterIsRefreshed", Setting::WaterIsRefreshed);
+    }
+    return Setting::Unknown;
+}
+
+static_assert(settingFromName("weight") == Setting::Weight, "setting dispatch");
+static_assert(settingFromName("waterIsRefreshed") == Setting::WaterIsRefreshed, "setting dispatch");
+static_assert(settingFromName("weigh") == Setting::Unknown, "setting dispatch");
+
+// A setting of a CatAway before it is rendered as text (CatAway::get)
+struct SettingValue {
+    enum class Kind : uint8_t { None, Integer, Decimal, Flag, Time, Text };
+
+    Kind kind = Kind::None;
+    int64_t integer = 0;        // Integer, Flag, Time
+    double decimal = 0;
+    string text;
+
+    // Empty for None (the actions, foodIsRefilled, ..., and the unknown names)
+    string render() const {
+        switch (kind) {
+        case Kind::Integer: return to_string(integer);
+        case Kind::Decimal: return to_string(decimal);
+        case Kind::Flag:    return integer != 0 ? "true" : "false";
+        case Kind::Time: {
+            // ctime, without its static buffer: dispensers are rendered on many threads at once
+            time_t time = static_cast<time_t>(integer);
+            char buffer[32];
+            return ctime_r(&time, buffer) != nullptr ? buffer : "";
+        }
+        case Kind::Text:    return text;
+        default:            return "";
+        }
+    }
+};
+
+// What the GET routes answer about a dispenser: a copy of its settings, taken under its lock after every
+// change and then only read (see Device::settings). Rendering is left to the readers, so a write does not
+// pay for the texts of all the settings.
+struct SettingsView {
+    array<SettingValue, static_cast<size_t>(Setting::Unknown)> values;
+
+    string get(Setting setting) const {
+        return setting == Setting::Unknown ? "" : values[static_cast<size_t>(setting)].render();
+    }
+};
+
+// The rule of buffers.json a value of the setting must match, nullptr for the settings that are not input
+const Validators::Dfa* settingValidator(Setting setting) {
+    switch (setting) {
+        case Setting::Weight:               return &Validators::weight;
+        case Setting::Age:                  return &Validators::age;
+        case Setting::EatingSpeed:          return &Validators::eatingSpeed;
+        case Setting::BreakDuration:        return &Validators::breakDuration;
+        case Setting::FeedingSchedule:      return &Validators::feedingSchedule;
+        case Setting::WaterBowlCapacityMl:  return &Validators::waterBowlCapacityMl;
+        case Setting::WaterLastRefreshed:   return &Validators::waterLastRefreshed;
+        case Setting::WaterRefSchedule:     return &Validators::waterRefSchedule;
+        case Setting::FoodExpDate:          return &Validators::foodExpDate;
+        case Setting::EmptyFoodTank:        return &Validators::emptyFoodTank;
+        case Setting::EmptyWaterTank:       return &Validators::emptyWaterTank;
+        case Setting::LastConsumedFood:     return &Validators::lastConsumedFood;
+        case Setting::LastConsumedWater:    return &Validators::lastConsumedWater;
+        case Setting::FoodIsRefilled:       return &Validators::foodIsRefilled;
+        case Setting::WaterIsRefilled:      return &Validators::waterIsRefilled;
+        case Setting::WaterIsRefreshed:     return &Validators::waterIsRefreshed;
+        default:                            return nullptr;
+    }
+}
+
+// The setting of every field of the telemetry frames, resolved at compile time
+constexpr array<Setting, sizeof(Frames::fields) / sizeof(Frames::fields[0])> frameSettings = [] {
+    array<Setting, sizeof(Frames::fields) / sizeof(Frames::fields[0])> settings = {};
+    for (size_t i = 0; i < settings.size(); i++)
+        settings[i] = settingFromName(Frames::fields[i].setting);
+    return settings;
+}();
 
 
 
@@ -34,14 +224,227 @@ void printCookies(const Http::Request& req) {
     std::cout << "]" << std::endl;
 }
 
+// Handler time, lock wait and status codes of every route, served on /metrics
+RequestMetrics requestMetrics;
+
+// Answers a request; the status code is counted on /metrics
+void reply(Http::ResponseWriter& response, Http::Code code, const string& body) {
+    requestMetrics.status(static_cast<int>(code));
+    response.send(code, body);
+}
+
 namespace Generic {
 
     void handleReady(const Rest::Request&, Http::ResponseWriter response) {
-        response.send(Http::Code::Ok, "1\n");
+        reply(response, Http::Code::Ok, "1\n");
+    }
+
+}
+
+// Recommended food, as a table: for every age group, the daily portion (in cups) up to each weight limit (in kg).
+// A cat heavier than the last limit of its group, or younger than 2 months, gets 0 cups, as before.
+const int FoodSteps = 9;                  // the most limits in a group
+const int GramsPerCup = 224;
+const int DefaultPortionG = 70;           // portia medie, when age or weight are not known
+
+struct FoodGroup {
+    double weightLimit[FoodSteps];        // padded with the last limit, so the padding steps are empty
+    float cups[FoodSteps];
+};
+
+constexpr FoodGroup foodGroups[] = {
+    // adult (> 1 an)
+    {{1.8, 3.6, 5.4, 7.2, 9.0, 9.0, 9.0, 9.0, 9.0}, {0.25, 0.5, 0.75, 1.0, 1.25, 0, 0, 0, 0}},
+    // [2, 5) luni
+    {{0.9, 1.8, 2.7, 3.6, 4.5, 5.4, 6.3, 8.1, 9.0}, {0.5, 0.75, 1.0, 1.25, 1.5, 1.75, 2.0, 2.25, 2.5}},
+    // [5, 7) luni
+    {{0.9, 2.7, 4.5, 6.3, 9.0, 9.0, 9.0, 9.0, 9.0}, {0.25, 0.5, 0.75, 1.0, 1.25, 0, 0, 0, 0}},
+    // [7, 12] luni
+    {{1.8, 4.5, 7.2, 9.0, 9.0, 9.0, 9.0, 9.0, 9.0}, {0.25, 0.5, 0.75, 1.0, 0, 0, 0, 0, 0}},
+};
+const int NrFoodGroups = sizeof(foodGroups) / sizeof(foodGroups[0]);
+
+// The age groups do not overlap, so the index is a sum of comparisons instead of a ladder of branches.
+// Kittens under 2 months get NrFoodGroups, which matches no group.
+constexpr int foodGroup(float age) {
+    return 4 - 4 * (age > 1.0)
+             - 3 * ((age >= 0.17) & (age < 0.42))
+             - 2 * ((age >= 0.42) & (age < 0.58))
+             - 1 * ((age >= 0.58) & (age <= 1.0));
+}
+
+// Recommended quantity of food in g for one cat.
+// Every step of the table is tested against the constant limits (no branches, no lookups by index),
+// so the batch loop below is vectorized by the compiler.
+constexpr int recommendedFoodG(float age, float weight) {
+    int group = foodGroup(age);
+    float cups = 0;
+    for (int g = 0; g < NrFoodGroups; g++) {
+        for (int i = 0; i < FoodSteps; i++) {
+            double lower = i == 0 ? 0.0 : foodGroups[g].weightLimit[i - 1];
+            bool inStep = (group == g) & (i == 0 || weight > lower) & (weight <= foodGroups[g].weightLimit[i]);
+            cups += inStep * foodGroups[g].cups[i];
+        }
+    }
+    int grams = GramsPerCup * cups;
+    bool unknown = (weight == -1.0) | (age == -1.0);
+    return grams + unknown * (DefaultPortionG - grams);
+}
+
+static_assert(recommendedFoodG(4.0, 4.2) == 168, "food table");
+static_assert(recommendedFoodG(0.3, 2.5) == 224, "food table");
+static_assert(recommendedFoodG(-1.0, 4.2) == DefaultPortionG, "food table");
+
+// Recommended food for many cats at once, over contiguous columns of ages and weights
+void recommendedFoodG(const float* ages, const float* weights, int* grams, size_t count) {
+    for (size_t i = 0; i < count; i++)
+        grams[i] = recommendedFoodG(ages[i], weights[i]);
+}
+
+// A daily schedule ("08:00-19:00-"), parsed once, when it is set, into minutes of the day
+struct Schedule {
+    static const int MaxTimes = 16;
+    uint16_t minutes[MaxTimes];
+    int count = 0;
+
+    // Reads every HH:MM (or H:MM) of the text, whatever separates them
+    static Schedule parse(string_view text) {
+        Schedule schedule;
+        size_t i = 0;
+        while (i < text.size() && schedule.count < MaxTimes) {
+            if (!isdigit(static_cast<unsigned char>(text[i]))) {
+                i++;
+                continue;
+            }
+            int hours = 0;
+            for (int digits = 0; digits < 2 && i < text.size() && isdigit(static_cast<unsigned char>(text[i])); digits++, i++)
+                hours = hours * 10 + (text[i] - '0');
+            if (i + 2 >= text.size() || text[i] != ':'
+                    || !isdigit(static_cast<unsigned char>(text[i + 1])) || !isdigit(static_cast<unsigned char>(text[i + 2])))
+                continue;
+            int minutes = (text[i + 1] - '0') * 10 + (text[i + 2] - '0');
+            i += 3;
+            if (hours < 24 && minutes < 60)
+                schedule.minutes[schedule.count++] = hours * 60 + minutes;
+        }
+        return schedule;
+    }
+};
+
+const string DefaultSchedule = "08:00-19:00-";
+
+// One reading of a dispenser's sensors: food (g) or water (ml) taken out of the tank at a given time
+struct ConsumptionEvent {
+    enum Kind { Food, Water };
+    Kind kind;
+    time_t time;
+    int amount;
+};
+
+// Readers of the text batches, one record per line: they never go past the end of the line they are on
+// (strtoll and strtof alone would skip a line end as a blank)
+const char* skipBlanks(const char* pos) {
+    while (*pos == ' ' || *pos == '\t')
+        pos++;
+    return pos;
+}
+
+// True when only blanks are left on the line
+bool atLineEnd(const char* pos) {
+    pos = skipBlanks(pos);
+    if (*pos == '\r')
+        pos++;
+    return *pos == '\n' || *pos == '\0';
+}
+
+// The integer after the blanks at pos, on the same line
+bool readInteger(const char*& pos, long long& value) {
+    const char* start = skipBlanks(pos);
+    if (!isdigit(static_cast<unsigned char>(*start)) && *start != '-' && *start != '+')
+        return false;
+    char* end;
+    errno = 0;
+    value = strtoll(start, &end, 10);
+    if (end == start || errno == ERANGE)
+        return false;
+    pos = end;
+    return true;
+}
+
+// The decimal number after the blanks at pos, on the same line
+bool readDecimal(const char*& pos, float& value) {
+    const char* start = skipBlanks(pos);
+    if (!isdigit(static_cast<unsigned char>(*start)) && *start != '.' && *start != '-' && *start != '+')
+        return false;
+    char* end;
+    value = strtof(start, &end);
+    if (end == start)
+        return false;
+    pos = end;
+    return true;
+}
+
+// Calls parse(pos) for every line of body that is not blank, pos at its first character; parse
+// returns where it stopped, or null when the line is malformed. A line must end after what parse read.
+// On a malformed line returns false with its number (blank lines count) in badLine.
+template<typename Parse>
+bool forEachTextLine(const string& body, size_t& badLine, Parse parse) {
+    badLine = 0;
+    size_t lineNumber = 0;
+    const char* line = body.c_str();
+    const char* bodyEnd = line + body.size();
+    while (line < bodyEnd) {
+        const char* next = static_cast<const char*>(memchr(line, '\n', bodyEnd - line));
+        next = next == nullptr ? bodyEnd : next + 1;
+        lineNumber++;
+        if (!atLineEnd(line)) {
+            const char* end = parse(skipBlanks(line));
+            if (end == nullptr || !atLineEnd(end)) {
+                badLine = lineNumber;
+                return false;
+            }
+        }
+        line = next;
     }
+    return true;
+}
+
+// Parses a batch of "<food|water> <unix time> <amount>" lines and sorts it by time.
+// On a malformed line returns false with the line number in badLine.
+bool parseConsumptionEvents(const string& body, vector<ConsumptionEvent>& events, size_t& badLine) {
+    bool parsed = forEachTextLine(body, badLine, [&](const char* pos) -> const char* {
+        ConsumptionEvent event;
+        if (strncmp(pos, "food", 4) == 0) {
+            event.kind = ConsumptionEvent::Food;
+            pos += 4;
+        } else if (strncmp(pos, "water", 5) == 0) {
+            event.kind = ConsumptionEvent::Water;
+            pos += 5;
+        } else {
+            return nullptr;
+        }
 
+        long long time, amount;
+        if ((*pos != ' ' && *pos != '\t') || !readInteger(pos, time) || !readInteger(pos, amount) ||
+                time < 0 || time > ConsumptionHistory::MaxTime || amount < 0 || amount > INT32_MAX)
+            return nullptr;
+
+        event.time = static_cast<time_t>(time);
+        event.amount = static_cast<int>(amount);
+        events.push_back(event);
+        return pos;
+    });
+    if (!parsed)
+        return false;
+    stable_sort(events.begin(), events.end(), [](const ConsumptionEvent& a, const ConsumptionEvent& b) {
+        return a.time < b.time;
+    });
+    return true;
 }
 
+// The clock every CatAway predicts with
+Clock dispenserClock;
+
 struct Cat    // stateful app
 {
 	string name;                                            // unique name for cat (identification purposes)
@@ -52,18 +455,380 @@ struct Cat    // stateful app
     int recFoodG = -1;                                     //recommended quantity of food in g
     int nrBreaks;
 };
-vector<Cat*> saved_Cats;    // pentru toate pisicile care folosesc dispenser-ul
+
+// A cat profile whose text fields are views: into a Cat, a row of the registry or an import body
+struct CatProfile
+{
+    string_view name;
+    float age = 0;
+    float weight = 0;
+    string_view eatingSpeed;
+    string_view feedingSchedule;
+    int recFoodG = -1;
+    int nrBreaks = 0;
+
+    CatProfile() = default;
+    CatProfile(const Cat& cat)
+        : name(cat.name), age(cat.age), weight(cat.weight), eatingSpeed(cat.eatingSpeed),
+          feedingSchedule(cat.feedingSchedule), recFoodG(cat.recFoodG), nrBreaks(cat.nrBreaks)
+    { }
+};
+
+// Breaks of a meal for the eatingSpeed rule's values; -1 for anything else
+int nrBreaksFor(string_view eatingSpeed) {
+    if (eatingSpeed == "slow")
+        return 0;
+    if (eatingSpeed == "medium")
+        return 1;
+    if (eatingSpeed == "fast")
+        return 2;
+    return -1;
+}
+
+// What the write-ahead log and the snapshots hold: the whole state of a device, or a cat profile.
+// Both are images (not deltas), so replaying an older one than the current state is skipped by lsn.
+enum RecordType : uint8_t {
+    DeviceRecord = 1,
+    CatRecord = 2
+};
+
+void saveCat(RecordWriter& out, const CatProfile& cat) {
+    out.putString(cat.name);
+    out.put(cat.age);
+    out.put(cat.weight);
+    out.putString(cat.eatingSpeed);
+    out.putString(cat.feedingSchedule);
+    out.put(cat.recFoodG);
+    out.put(cat.nrBreaks);
+}
+
+bool loadCat(RecordReader& in, Cat& cat) {
+    in.getString(cat.name);
+    in.get(cat.age);
+    in.get(cat.weight);
+    in.getString(cat.eatingSpeed);
+    in.getString(cat.feedingSchedule);
+    in.get(cat.recFoodG);
+    in.get(cat.nrBreaks);
+    return in.ok();
+}
+
+// Registry of the cats, indexed by name (the name is the cat's identifier), stored by columns: one row per
+// cat, the names packed in one buffer, the eating speed as an enum and the feeding schedules interned (a
+// fleet shares a handful of them). A scan of one field (fleetStats) reads only its column.
+// Lookups are O(1) and take the lock shared, so GET /cat/:name requests never wait for each other,
+// only for the (short) insert of a POST /cat and, once per change of a profile, the caching of its body.
+class CatRegistry {
+public:
+    // Adds the cat, or replaces the profile saved under the same name.
+    // lsn is the profile's position in the write-ahead log: an older profile never replaces a newer one.
+    void save(const CatProfile& cat, uint64_t lsn = 0) {
+        std::unique_lock<std::shared_mutex> writeGuard(lock);
+        saveRow(cat, lsn);
+    }
+
+    // Saves count cats (a POST /cat or an import batch) under one lock, each with the lsn log(i) returns
+    // when appending it to the write-ahead log. The append is made under the lock too, so a checkpoint
+    // (which rotates the log, then reads the registry) sees every profile whose record is in an older log.
+    // Returns the last lsn.
+    template<typename Log>
+    uint64_t save(const CatProfile* cats, size_t count, Log log) {
+        std::unique_lock<std::shared_mutex> writeGuard(lock);
+        uint64_t lsn = 0;
+        for (size_t i = 0; i < count; i++) {
+            lsn = log(i);
+            saveRow(cats[i], lsn);
+        }
+        return lsn;
+    }
+
+    // The GET /cat/:name body; null for an unknown cat. It is rendered on the first lookup after the profile
+    // changed (outside the lock, from a copy of the row) and kept in the row until the next save.
+    shared_ptr<const string> findDetails(const string& name) const {
+        Cat cat;
+        uint32_t row;
+        uint64_t version;
+        {
+            std::shared_lock<std::shared_mutex> readGuard(lock);
+            row = find(name);
+            if (row == NoRow)
+                return nullptr;
+            if (details[row] != nullptr)
+                return details[row];
+            cat = rowCat(row);
+            version = saves;
+        }
+        auto rendered = std::make_shared<const string>(renderDetails(cat));
+        std::unique_lock<std::shared_mutex> writeGuard(lock);
+        if (saves == version)               // else the row may have changed meanwhile: rendered again next time
+            details[row] = rendered;
+        return rendered;
+    }
+
+    // Calls visit(cat, lsn) for every cat, under the read lock (the Cat is rebuilt from its row)
+    template<typename Visit>
+    void forEach(Visit visit) const {
+        std::shared_lock<std::shared_mutex> readGuard(lock);
+        for (uint32_t row = 0; row < lsns.size(); row++)
+            visit(rowCat(row), lsns[row]);
+    }
+
+    // Calls visit(profile) for at most count cats from row first on, under the read lock; the views are
+    // into the registry and end with the call. Returns the row to continue from (size() at the end), so a
+    // long scan lets writers in between its chunks.
+    template<typename Visit>
+    uint32_t forEachFrom(uint32_t first, size_t count, Visit visit) const {
+        std::shared_lock<std::shared_mutex> readGuard(lock);
+        uint32_t end = static_cast<uint32_t>(min<size_t>(lsns.size(), first + count));
+        for (uint32_t row = first; row < end; row++) {
+            CatProfile cat;
+            cat.name = rowName(row);
+            cat.age = ages[row];
+            cat.weight = weights[row];
+            cat.eatingSpeed = speedName(speeds[row]);
+            cat.feedingSchedule = scheduleTexts[schedules[row]];
+            cat.recFoodG = recFoodG[row];
+            cat.nrBreaks = nrBreaks[row];
+            visit(cat);
+        }
+        return max(first, end);
+    }
+
+    struct FleetStats {
+        size_t cats = 0;
+        double meanAge = 0;
+        double meanWeight = 0;
+        size_t bySpeed[4] = {};                 // other, slow, medium, fast
+        int64_t recFoodG = 0;                   // a day, for the whole fleet
+        size_t bytes = 0;                       // memoryBytes
+
+        // Adds the stats of another registry (a thread-per-core server has one per core)
+        void add(const FleetStats& other) {
+            size_t total = cats + other.cats;
+            if (total != 0) {
+                meanAge = (meanAge * cats + other.meanAge * other.cats) / total;
+                meanWeight = (meanWeight * cats + other.meanWeight * other.cats) / total;
+            }
+            cats = total;
+            for (int speed = 0; speed < 4; speed++)
+                bySpeed[speed] += other.bySpeed[speed];
+            recFoodG += other.recFoodG;
+            bytes += other.bytes;
+        }
+    };
+
+    FleetStats fleetStats() const {
+        std::shared_lock<std::shared_mutex> readGuard(lock);
+        FleetStats stats;
+        stats.cats = lsns.size();
+        stats.meanAge = stats.cats == 0 ? 0 : sum(ages) / stats.cats;
+        stats.meanWeight = stats.cats == 0 ? 0 : sum(weights) / stats.cats;
+        for (EatingSpeed speed : speeds)
+            stats.bySpeed[static_cast<int>(speed)]++;
+        for (int16_t grams : recFoodG)
+            stats.recFoodG += max<int16_t>(grams, 0);
+        stats.bytes = memoryBytes();
+        return stats;
+    }
+
+    // What the registry takes on the heap, with the room reserved by its vectors
+    size_t memoryBytes() const {
+        size_t bytes = names.capacity() + capacityBytes(nameEnds) + capacityBytes(ages) + capacityBytes(weights) +
+                       capacityBytes(speeds) + capacityBytes(schedules) + capacityBytes(recFoodG) +
+                       capacityBytes(nrBreaks) + capacityBytes(lsns) + capacityBytes(details) + capacityBytes(index) +
+                       capacityBytes(scheduleTexts) + scheduleIds.bucket_count() * sizeof(void*);
+        for (const auto& body : details)    // make_shared: the count and the string in one block
+            if (body != nullptr)
+                bytes += 2 * sizeof(void*) + sizeof(string) + (body->capacity() > 15 ? body->capacity() + 1 : 0);
+        for (const string& text : scheduleTexts)
+            bytes += 2 * (text.capacity() > 15 ? text.capacity() + 1 : 0) + sizeof(pair<const string, uint32_t>) + 2 * sizeof(void*);
+        return bytes;
+    }
+
+private:
+    enum class EatingSpeed : uint8_t { Other, Slow, Medium, Fast };
+
+    static const uint32_t NoRow = UINT32_MAX;
+
+    void saveRow(const CatProfile& cat, uint64_t lsn) {
+        uint32_t row = find(cat.name);
+        if (row == NoRow) {
+            row = static_cast<uint32_t>(lsns.size());
+            names.append(cat.name);
+            nameEnds.push_back(static_cast<uint32_t>(names.size()));
+            ages.push_back(0);
+            weights.push_back(0);
+            speeds.push_back(EatingSpeed::Other);
+            schedules.push_back(0);
+            recFoodG.push_back(0);
+            nrBreaks.push_back(0);
+            lsns.push_back(0);
+            details.emplace_back();
+            addToIndex(row);
+        }
+        else if (lsns[row] > lsn && lsn != 0)
+            return;
+        details[row] = nullptr;
+        saves++;
+        ages[row] = cat.age;
+        weights[row] = cat.weight;
+        speeds[row] = speedFromName(cat.eatingSpeed);
+        schedules[row] = intern(cat.feedingSchedule);
+        recFoodG[row] = static_cast<int16_t>(cat.recFoodG);
+        nrBreaks[row] = static_cast<uint8_t>(cat.nrBreaks);
+        lsns[row] = lsn;
+    }
+
+    static EatingSpeed speedFromName(string_view name) {
+        if (name == "slow")
+            return EatingSpeed::Slow;
+        if (name == "medium")
+            return EatingSpeed::Medium;
+        if (name == "fast")
+            return EatingSpeed::Fast;
+        return EatingSpeed::Other;          // not a value of the eatingSpeed rule, kept as ""
+    }
+
+    static const char* speedName(EatingSpeed speed) {
+        static const char* names[] = {"", "slow", "medium", "fast"};
+        return names[static_cast<int>(speed)];
+    }
+
+    string_view rowName(uint32_t row) const {
+        uint32_t start = row == 0 ? 0 : nameEnds[row - 1];
+        return string_view(names.data() + start, nameEnds[row] - start);
+    }
+
+    Cat rowCat(uint32_t row) const {
+        Cat cat;
+        cat.name = string(rowName(row));
+        cat.age = ages[row];
+        cat.weight = weights[row];
+        cat.eatingSpeed = speedName(speeds[row]);
+        cat.feedingSchedule = scheduleTexts[schedules[row]];
+        cat.recFoodG = recFoodG[row];
+        cat.nrBreaks = nrBreaks[row];
+        return cat;
+    }
+
+    // An import mostly repeats the schedule of the cat before it: that one is found without a string
+    uint32_t intern(string_view schedule) {
+        if (lastSchedule < scheduleTexts.size() && scheduleTexts[lastSchedule] == schedule)
+            return lastSchedule;
+        string text(schedule);
+        auto it = scheduleIds.find(text);
+        if (it != scheduleIds.end())
+            return lastSchedule = it->second;
+        uint32_t id = static_cast<uint32_t>(scheduleTexts.size());
+        scheduleTexts.push_back(text);
+        scheduleIds.emplace(move(text), id);
+        return lastSchedule = id;
+    }
+
+    // The index is open addressing over row + 1 (0 is an empty slot), at most half full
+    uint32_t find(string_view name) const {
+        if (index.empty())
+            return NoRow;
+        size_t mask = index.size() - 1;
+        for (size_t slot = std::hash<string_view>()(name) & mask; index[slot] != 0; slot = (slot + 1) & mask)
+            if (rowName(index[slot] - 1) == name)
+                return index[slot] - 1;
+        return NoRow;
+    }
+
+    void addToIndex(uint32_t row) {
+        if (2 * (row + 1) > index.size()) {
+            vector<uint32_t> grown(max<size_t>(16, 2 * index.size()), 0);
+            index.swap(grown);
+            for (uint32_t existing = 0; existing < row; existing++)
+                placeInIndex(existing);
+        }
+        placeInIndex(row);
+    }
+
+    void placeInIndex(uint32_t row) {
+        size_t mask = index.size() - 1;
+        size_t slot = std::hash<string_view>()(rowName(row)) & mask;
+        while (index[slot] != 0)
+            slot = (slot + 1) & mask;
+        index[slot] = row + 1;
+    }
+
+    // In independent lanes, so the compiler can keep them in one vector register
+    static double sum(const vector<float>& column) {
+        const size_t Lanes = 8;
+        float lanes[Lanes] = {};
+        size_t i = 0;
+        for (; i + Lanes <= column.size(); i += Lanes)
+            for (size_t lane = 0; lane < Lanes; lane++)
+                lanes[lane] += column[i + lane];
+        double total = 0;
+        for (; i < column.size(); i++)
+            total += column[i];
+        for (float lane : lanes)
+            total += lane;
+        return total;
+    }
+
+    template<typename T>
+    static size_t capacityBytes(const vector<T>& column) {
+        return column.capacity() * sizeof(T);
+    }
+
+    static string renderDetails(const Cat& cat) {
+        return "Name: " + cat.name + "\nAge: " + to_string(cat.age).substr(0, 4) + "\nWeight: " + to_string(cat.weight).substr(0, 4) +
+               "\nEating Speed: " + cat.eatingSpeed + "\nFeeding Schedule: " + cat.feedingSchedule +
+               "\nRecommended Quantity of Food (g): " + to_string(cat.recFoodG) + "\nNr of Breaks: " + to_string(cat.nrBreaks) + "\n";
+    }
+
+    mutable std::shared_mutex lock;
+    string names;                       // all the names, one after the other
+    vector<uint32_t> nameEnds;          // where the name of each row ends in names
+    vector<float> ages;
+    vector<float> weights;
+    vector<EatingSpeed> speeds;
+    vector<uint32_t> schedules;         // in scheduleTexts
+    vector<int16_t> recFoodG;
+    vector<uint8_t> nrBreaks;
+    vector<uint64_t> lsns;
+    mutable vector<shared_ptr<const string>> details;  // the GET /cat/:name bodies, null until looked up
+    uint64_t saves = 0;                 // rows saved so far: a body rendered meanwhile may be stale
+    vector<uint32_t> index;             // name -> row + 1
+    vector<string> scheduleTexts;
+    unordered_map<string, uint32_t> scheduleIds;
+    uint32_t lastSchedule = 0;          // the schedule interned last
+};
 
 
 class CatAwayEndpoint {
 public:
-    explicit CatAwayEndpoint(Address addr)
-        : httpEndpoint(std::make_shared<Http::Endpoint>(addr))
-    { }
+    // With a data directory, the state is recovered from it and every change is logged there
+    explicit CatAwayEndpoint(Address addr, const string& dataDir = "")
+        : dataDir(dataDir), httpEndpoint(std::make_shared<Http::Endpoint>(addr))
+    {
+        // The legacy routes (without /device/:id) work on this dispenser
+        devices.get(DefaultDevice);
+
+        if (!dataDir.empty())
+            recover();
+    }
 
-    void init(size_t thr = 2) {
+    ~CatAwayEndpoint() {
+        stopForwarding();
+        stopMqtt();
+        stopTelemetry();
+        stopStatusFeed();
+        stopAlertTimers();
+        stopCheckpoints();
+    }
+
+    // With sharedPort, other endpoints (the other cores of a CatAwayCores) listen on the same port
+    void init(size_t thr = 2, bool sharedPort = false) {
         auto opts = Http::Endpoint::options()
-            .threads(static_cast<int>(thr));
+            .threads(static_cast<int>(thr))
+            .maxRequestSize(MaxBatchBytes);        // room for the batch endpoints
+        if (sharedPort)
+            opts.flags(Tcp::Options::ReuseAddr | Tcp::Options::ReusePort);
         httpEndpoint->init(opts);
         // Server routes are loaded up
         setupRoutes();
@@ -71,30 +836,256 @@ public:
 
     // Server is started threaded.  
     void start() {
+        statusFeed = thread(&CatAwayEndpoint::statusFeedLoop, this);
+        alertTimerThread = thread(&CatAwayEndpoint::alertTimerLoop, this);
+        if (!partitions.empty())
+            for (int i = 0; i < ForwardThreads; i++)
+                forwarders.emplace_back(&CatAwayEndpoint::forwardLoop, this);
         httpEndpoint->setHandler(router.handler());
         httpEndpoint->serveThreaded();
     }
 
+    // The binary telemetry listener, on TCP and UDP port; every thread serves its own connections
+    bool startTelemetry(uint16_t port, int threads = 1) {
+        telemetryTcp = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+        telemetryUdp = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK, 0);
+        sockaddr_in addr = {};
+        addr.sin_family = AF_INET;
+        addr.sin_port = htons(port);
+        addr.sin_addr.s_addr = htonl(INADDR_ANY);
+        int one = 1;
+        setsockopt(telemetryTcp, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+        if (telemetryTcp < 0 || telemetryUdp < 0
+                || ::bind(telemetryTcp, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) != 0
+                || listen(telemetryTcp, SOMAXCONN) != 0
+                || ::bind(telemetryUdp, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) != 0) {
+            perror("telemetry listener");
+            return false;
+        }
+        for (int i = 0; i < threads; i++)
+            telemetryThreads.emplace_back(&CatAwayEndpoint::telemetryLoop, this);
+        return true;
+    }
+
+    // One connection to the broker, for both directions: the telemetry topics are subscribed to (their
+    // messages are applied by a thread of their own, a batch of them per device at a time) and the state of
+    // every changed dispenser is published by another (see mqttPublishLoop).
+    bool startMqtt(const string& host = "localhost", int port = 1883) {
+        mosquitto_lib_init();
+        mqttClient = mosquitto_new("cataway-server", true, this);
+        if (mqttClient == nullptr)
+            return false;
+        mosquitto_connect_callback_set(mqttClient, [](struct mosquitto* mosq, void*, int rc) {
+            // (re)subscribed on every connection: the session is clean.
+            // Only the telemetry: the state topics published under the same prefix do not come back.
+            if (rc != 0)
+                return;
+            mosquitto_subscribe(mosq, nullptr, (string(MqttTopicPrefix) + "+/consumption").c_str(), 1);
+            mosquitto_subscribe(mosq, nullptr, (string(MqttTopicPrefix) + "+/settings/+").c_str(), 1);
+        });
+        mosquitto_message_callback_set(mqttClient, [](struct mosquitto*, void* endpoint, const struct mosquitto_message* message) {
+            static_cast<CatAwayEndpoint*>(endpoint)->mqttReceived(message);
+        });
+        int rc = mosquitto_connect(mqttClient, host.c_str(), port, 60);
+        if (rc != MOSQ_ERR_SUCCESS) {
+            fprintf(stderr, "MQTT: could not connect to %s:%d: %s\n", host.c_str(), port, mosquitto_strerror(rc));
+            mosquitto_destroy(mqttClient);
+            mqttClient = nullptr;
+            return false;
+        }
+        mqttApplier = thread(&CatAwayEndpoint::mqttApplyLoop, this);
+        mqttPublisher = thread(&CatAwayEndpoint::mqttPublishLoop, this);
+        mosquitto_loop_start(mqttClient);
+        return true;
+    }
+
     // When signaled server shuts down
     void stop(){
+        stopMqtt();
+        stopTelemetry();
         httpEndpoint->shutdown();
+        stopForwarding();
+        stopStatusFeed();
+        stopAlertTimers();
+        stopCheckpoints();
+        if (wal.isOpen())
+            checkpoint();
+    }
+
+    // Makes this endpoint the core `partition` of a thread-per-core server: the requests for a dispenser
+    // of another core are handed over to it (called before start)
+    void partitionWith(const vector<CatAwayEndpoint*>& all, size_t partition) {
+        partitions = all;
+        this->partition = partition;
+    }
+
+    // The core of a thread-per-core server owning the dispenser, or the cat by its name (independent of
+    // the shard of DeviceRegistry)
+    static size_t partitionOf(string_view id, size_t partitions) {
+        return static_cast<size_t>((std::hash<string_view>()(id) * 0x9E3779B97F4A7C15ull) >> 32) % partitions;
     }
 
 private:
+    friend class CatAwayBench;
+    friend class CatAwayCores;
+    friend class CatAwaySimulation;
+
+    static const size_t MaxBatchBytes = 1 << 20;
+    static constexpr size_t ImportBatch = 256;        // cats whose derived fields are computed together
+    static constexpr size_t ExportRows = 512;         // cats rendered in one chunk of GET /cats/export
+
     void setupRoutes() {
         using namespace Rest;
-        Routes::Get(router, "/ready", Routes::bind(&Generic::handleReady));
-        Routes::Get(router, "/auth", Routes::bind(&CatAwayEndpoint::doAuth, this));
-        Routes::Post(router, "/settings/add/:addSetting/:value", Routes::bind(&CatAwayEndpoint::addSetting, this));
-        Routes::Get(router, "/settings/:resultSetting", Routes::bind(&CatAwayEndpoint::getSetting, this));
-        Routes::Get(router, "/recommendedFood", Routes::bind(&CatAwayEndpoint::getRecFood, this));
-        Routes::Get(router, "/fillWater", Routes::bind(&CatAwayEndpoint::fillWater, this));
-        Routes::Get(router, "/getBreaks", Routes::bind(&CatAwayEndpoint::getBreaks, this));
-        Routes::Get(router, "/lastRefresh", Routes::bind(&CatAwayEndpoint::getLastRefresh, this));
-        Routes::Get(router, "/currentQuantity/:option", Routes::bind(&CatAwayEndpoint::getCurrentQuantity, this));
-        Routes::Get(router, "/dispenserStatus", Routes::bind(&CatAwayEndpoint::getStatus, this));
-        Routes::Post(router, "/cat/:name/:age/:weight/:eatingSpeed/:feedingSchedule", Routes::bind(&CatAwayEndpoint::setCatDetails, this));  // stateful app -> luăm informațiile pt pisi
-        Routes::Get(router, "/cat/:name", Routes::bind(&CatAwayEndpoint::getCatDetails, this));  // stateful app
+        // Every route is measured: handler time, lock wait and status codes are on /metrics.
+        // Those of a dispenser are served by the core owning it; the others (getAny, postAny) wherever they
+        // land, the cat routes with the registry and the log of the core owning the cat (catOwner).
+        auto get = [this](const string& path, Route::Handler handler) { Routes::Get(router, path, measured(path, handler, true)); };
+        auto post = [this](const string& path, Route::Handler handler) { Routes::Post(router, path, measured(path, handler, true)); };
+        auto getAny = [this](const string& path, Route::Handler handler) { Routes::Get(router, path, measured(path, handler, false)); };
+        auto postAny = [this](const string& path, Route::Handler handler) { Routes::Post(router, path, measured(path, handler, false)); };
+
+        getAny("/ready", Routes::bind(&Generic::handleReady));
+        getAny("/auth", Routes::bind(&CatAwayEndpoint::doAuth, this));
+        post("/settings/add/:addSetting/:value", Routes::bind(&CatAwayEndpoint::addSetting, this));
+        get("/settings/:resultSetting", Routes::bind(&CatAwayEndpoint::getSetting, this));
+        get("/recommendedFood", Routes::bind(&CatAwayEndpoint::getRecFood, this));
+        postAny("/recommendedFood/batch", Routes::bind(&CatAwayEndpoint::getRecFoodBatch, this));
+        get("/fillWater", Routes::bind(&CatAwayEndpoint::fillWater, this));
+        get("/getBreaks", Routes::bind(&CatAwayEndpoint::getBreaks, this));
+        get("/lastRefresh", Routes::bind(&CatAwayEndpoint::getLastRefresh, this));
+        get("/currentQuantity/:option", Routes::bind(&CatAwayEndpoint::getCurrentQuantity, this));
+        get("/dispenserStatus", Routes::bind(&CatAwayEndpoint::getStatus, this));
+        postAny("/cat/:name/:age/:weight/:eatingSpeed/:feedingSchedule", Routes::bind(&CatAwayEndpoint::setCatDetails, this));  // stateful app -> luăm informațiile pt pisi
+        getAny("/cat/:name", Routes::bind(&CatAwayEndpoint::getCatDetails, this));  // stateful app
+        getAny("/cats/stats", Routes::bind(&CatAwayEndpoint::getFleetStats, this));
+        postAny("/cats/import", Routes::bind(&CatAwayEndpoint::importCats, this));
+        getAny("/cats/export", Routes::bind(&CatAwayEndpoint::exportCats, this));
+        post("/consumption/batch", Routes::bind(&CatAwayEndpoint::addConsumptionBatch, this));
+        get("/history/:kind/:from/:to", Routes::bind(&CatAwayEndpoint::getHistory, this));
+        getAny("/metrics", Routes::bind(&CatAwayEndpoint::getMetrics, this));
+        get("/status/:since", Routes::bind(&CatAwayEndpoint::watchStatus, this));
+
+        // Fleet mode: the same handlers, addressed to one dispenser out of many
+        post("/device/:id/settings/add/:addSetting/:value", Routes::bind(&CatAwayEndpoint::addSetting, this));
+        get("/device/:id/settings/:resultSetting", Routes::bind(&CatAwayEndpoint::getSetting, this));
+        get("/device/:id/recommendedFood", Routes::bind(&CatAwayEndpoint::getRecFood, this));
+        get("/device/:id/fillWater", Routes::bind(&CatAwayEndpoint::fillWater, this));
+        get("/device/:id/getBreaks", Routes::bind(&CatAwayEndpoint::getBreaks, this));
+        get("/device/:id/lastRefresh", Routes::bind(&CatAwayEndpoint::getLastRefresh, this));
+        get("/device/:id/currentQuantity/:option", Routes::bind(&CatAwayEndpoint::getCurrentQuantity, this));
+        get("/device/:id/dispenserStatus", Routes::bind(&CatAwayEndpoint::getStatus, this));
+        post("/device/:id/consumption/batch", Routes::bind(&CatAwayEndpoint::addConsumptionBatch, this));
+        get("/device/:id/history/:kind/:from/:to", Routes::bind(&CatAwayEndpoint::getHistory, this));
+        get("/device/:id/status/:since", Routes::bind(&CatAwayEndpoint::watchStatus, this));
+    }
+
+    Rest::Route::Handler measured(const string& path, Rest::Route::Handler handler, bool perDevice) {
+        int route = requestMetrics.addRoute(path);
+        Rest::Route::Handler served = [route, handler](const Rest::Request& request, Http::ResponseWriter response) {
+            RequestMetrics::Measure measure(requestMetrics, route);
+            return handler(request, std::move(response));
+        };
+        if (!perDevice)
+            return served;
+        // Every core sets up the same routes in the same order, so the index names the route on the owner too
+        size_t forwardedRoute = routeHandlers.size();
+        routeHandlers.push_back(served);
+        return [this, forwardedRoute, served](const Rest::Request& request, Http::ResponseWriter response) {
+            if (!partitions.empty()) {
+                CatAwayEndpoint* owner = partitions[partitionOf(deviceId(request), partitions.size())];
+                if (owner != this) {
+                    owner->forward(forwardedRoute, request, std::move(response));
+                    return Rest::Route::Result::Ok;
+                }
+            }
+            return served(request, std::move(response));
+        };
+    }
+
+    // A request that landed on another core, served here by one of the ForwardThreads forwardLoops: it is
+    // measured on this core, where its work is done, and answered from here. A write blocks its thread in
+    // waitDurable, so the forwarded writes need several threads to share one fdatasync (group commit).
+    struct Forwarded {
+        size_t route;
+        Rest::Request request;
+        Http::ResponseWriter response;
+    };
+
+    void forward(size_t route, const Rest::Request& request, Http::ResponseWriter response) {
+        unique_lock<mutex> guard(forwardLock);
+        if (forwardStopping) {
+            guard.unlock();
+            reply(response, Http::Code::Service_Unavailable, "The server is shutting down\n");
+            return;
+        }
+        forwardPending.push_back(Forwarded{route, request, std::move(response)});
+        forwardWake.notify_one();
+    }
+
+    // Takes the forwarded requests one at a time, so a request waiting for the log holds up no other
+    void forwardLoop() {
+        for (;;) {
+            unique_lock<mutex> guard(forwardLock);
+            forwardWake.wait(guard, [this] { return !forwardPending.empty() || forwardStopping; });
+            if (forwardPending.empty())
+                return;
+            Forwarded forwarded = std::move(forwardPending.front());
+            forwardPending.pop_front();
+            guard.unlock();
+            routeHandlers[forwarded.route](forwarded.request, std::move(forwarded.response));
+        }
+    }
+
+    void stopForwarding() {
+        {
+            lock_guard<mutex> guard(forwardLock);
+            forwardStopping = true;
+            forwardWake.notify_all();
+        }
+        for (thread& forwarder : forwarders)
+            forwarder.join();
+        forwarders.clear();
+    }
+
+    // The endpoint whose registry and log keep the cat: in a thread-per-core server the core owning its
+    // name, whichever core serves the request. So every profile is in one registry and one snapshot.
+    CatAwayEndpoint& catOwner(string_view name) {
+        return partitions.empty() ? *this : *partitions[partitionOf(name, partitions.size())];
+    }
+
+    // Every endpoint keeping cats, in partition order
+    vector<CatAwayEndpoint*> catOwners() {
+        return partitions.empty() ? vector<CatAwayEndpoint*>{this} : partitions;
+    }
+
+    // Prometheus scrape of the request metrics
+    void getMetrics(const Rest::Request&, Http::ResponseWriter response) {
+        using namespace Http;
+        response.headers()
+                    .add<Header::Server>("pistache/0.1")
+                    .add<Header::ContentType>(MIME(Text, Plain));
+
+        reply(response, Http::Code::Ok, requestMetrics.prometheus());
+    }
+
+    // The dispenser a request is addressed to ("default" for the routes without /device/:id).
+    // Writes create the device on first use, reads only look it up.
+    string deviceId(const Rest::Request& request) {
+        if (request.hasParam(":id"))
+            return request.param(":id").as<std::string>();
+        return DefaultDevice;
+    }
+
+    void deviceNotFound(const string& id, Http::ResponseWriter& response) {
+        reply(response, Http::Code::Not_Found, "Device " + id + " was not found\n");
+    }
+
+    // Waits for the change to be on disk; when the log could not write it, answers 503 and returns false
+    bool durable(uint64_t lsn, Http::ResponseWriter& response) {
+        if (wal.waitDurable(lsn))
+            return true;
+        reply(response, Http::Code::Service_Unavailable, "The change was not saved to the write-ahead log\n");
+        return false;
     }
 
     
@@ -105,7 +1096,7 @@ private:
         response.cookies()
             .add(Http::Cookie("lang", "en-US"));
         // Send the response
-        response.send(Http::Code::Ok, "The CatAway setup has completed!");
+        reply(response, Http::Code::Ok, "The CatAway setup has completed!");
     }
 
     // Endpoint to configure one of the CatAway's settings.
@@ -113,26 +1104,52 @@ private:
         // You don't know what the parameter content that you receive is, but you should
         // try to cast it to some data structure. Here, I cast the settingName to string.
         auto settingName = request.param(":addSetting").as<std::string>();
+        Setting setting = settingFromName(settingName);
+        // An unknown name changes nothing: no device is created, locked, logged or waited for
+        if (setting == Setting::Unknown) {
+            reply(response, Http::Code::Not_Found, settingName + " was not found\n");
+            return;
+        }
 
-        // This is a guard that prevents editing the same value by two concurent threads. 
-        Guard guard(CatAwayLock);
-        
-        
         string val = "";
         if (request.hasParam(":value")) {
             auto value = request.param(":value");
             val = value.as<string>();
         }
-        
-        // Setting the CatAway's setting to value
-        int setResponse = cat.set(settingName, string(val));
+
+        // The value is checked against its rule before anything is locked or parsed, so a bad one
+        // is a 400 instead of an exception out of stof/stoi
+        const Validators::Dfa* validator = settingValidator(setting);
+        if (validator != nullptr && !Validators::matches(*validator, val)) {
+            reply(response, Http::Code::Bad_Request, "'" + val + "' is not a valid " + settingName +
+                  " (" + validator->rule + ")\n");
+            return;
+        }
+
+        // Only the addressed dispenser is locked, other devices keep being served.
+        Device& device = devices.get(deviceId(request));
+
+        int setResponse;
+        uint64_t lsn;
+        {
+            // This is a guard that prevents editing the same value by two concurent threads. 
+            MeasuredGuard guard(device.lock);
+
+            // Setting the CatAway's setting to value
+            setResponse = device.cat.set(setting, val);
+            lsn = logDevice(device);
+            deviceChanged(device);
+        }
+        // The answer waits for the change to be on disk (the lock is already released)
+        if (!durable(lsn, response))
+            return;
 
         // Sending some confirmation or error response.
         if (setResponse == 1) {
-            response.send(Http::Code::Ok, settingName + " was set to " + val + '\n');
+            reply(response, Http::Code::Ok, settingName + " was set to " + val + '\n');
         }
         else {
-            response.send(Http::Code::Not_Found, settingName + " was not found and or '" + val + "' was not a valid value ");
+            reply(response, Http::Code::Not_Found, settingName + " was not found and or '" + val + "' was not a valid value ");
         }
 
     }
@@ -141,9 +1158,15 @@ private:
     void getSetting(const Rest::Request& request, Http::ResponseWriter response){
         auto settingName = request.param(":resultSetting").as<std::string>();
 
-        Guard guard(CatAwayLock);
-
-        string valueSetting = cat.get(settingName);
+        string id = deviceId(request);
+        Device* device = devices.find(id);
+        if (device == nullptr) {
+            deviceNotFound(id, response);
+            return;
+        }
+        // The settings as of the last change, without the lock: reads never wait for the writes
+        Rcu::ReadSection section;
+        string valueSetting = device->settings.read(section)->get(settingFromName(settingName));
 
         if (valueSetting != "") {
 
@@ -153,17 +1176,102 @@ private:
                         .add<Header::Server>("pistache/0.1")
                         .add<Header::ContentType>(MIME(Text, Plain));
 
-            response.send(Http::Code::Ok, settingName + " is " + valueSetting);
+            reply(response, Http::Code::Ok, settingName + " is " + valueSetting);
         }
         else {
-            response.send(Http::Code::Not_Found, settingName + " was not found");
+            reply(response, Http::Code::Not_Found, settingName + " was not found");
         }
     }
 
-    void fillWater (const Rest::Request& request, Http::ResponseWriter response) {
-        Guard guard(CatAwayLock);
+    // Endpoint for the sensor readings a dispenser buffered: one "<food|water> <unix time> <amount>" per line.
+    // The body is parsed before locking; the events are applied and the refills predicted under one lock.
+    void addConsumptionBatch(const Rest::Request& request, Http::ResponseWriter response) {
+        vector<ConsumptionEvent> events;
+        size_t badLine;
+        if (!parseConsumptionEvents(request.body(), events, badLine)) {
+            reply(response, Http::Code::Bad_Request, "Line " + to_string(badLine) + " is not a \"<food|water> <unix time> <amount>\" event\n");
+            return;
+        }
+
+        Device& device = devices.get(deviceId(request));
+        uint64_t lsn;
+        {
+            MeasuredGuard guard(device.lock);
+            device.cat.consume(events);
+            lsn = logDevice(device);
+            deviceChanged(device);
+        }
+        if (!durable(lsn, response))
+            return;
+
+        reply(response, Http::Code::Ok, to_string(events.size()) + " consumption events were applied\n");
+    }
+
+    // What was eaten (kind "food") or drunk ("water") between two unix times, from the rollups of the device
+    void getHistory(const Rest::Request& request, Http::ResponseWriter response) {
+        auto kindName = request.param(":kind").as<std::string>();
+        auto fromText = request.param(":from").as<std::string>();
+        auto toText = request.param(":to").as<std::string>();
+
+        ConsumptionEvent::Kind kind;
+        if (kindName == "food")
+            kind = ConsumptionEvent::Food;
+        else if (kindName == "water")
+            kind = ConsumptionEvent::Water;
+        else {
+            reply(response, Http::Code::Not_Found, kindName + " has no history (food or water)\n");
+            return;
+        }
 
-        int status = cat.set(string("waterIsRefilled"), string(""));
+        char* fromEnd;
+        char* toEnd;
+        time_t from = strtoll(fromText.c_str(), &fromEnd, 10);
+        time_t to = strtoll(toText.c_str(), &toEnd, 10);
+        if (fromText.empty() || *fromEnd != '\0' || toText.empty() || *toEnd != '\0' || from > to ||
+                from < 0 || to > ConsumptionHistory::MaxTime) {
+            reply(response, Http::Code::Bad_Request, "The range must be two unix times, 0 <= from <= to <= " +
+                  to_string(ConsumptionHistory::MaxTime) + "\n");
+            return;
+        }
+
+        string id = deviceId(request);
+        Device* device = devices.find(id);
+        if (device == nullptr) {
+            deviceNotFound(id, response);
+            return;
+        }
+
+        ConsumptionHistory::Totals totals;
+        {
+            MeasuredGuard guard(device->lock);
+            totals = device->cat.getHistory(kind).query(from, to);
+        }
+
+        string unit = kind == ConsumptionEvent::Food ? " g" : " ml";
+
+        using namespace Http;
+        response.headers()
+                    .add<Header::Server>("pistache/0.1")
+                    .add<Header::ContentType>(MIME(Text, Plain));
+
+        reply(response, Http::Code::Ok, kindName + " consumed from " + to_string(from) + " to " + to_string(to) + ": " +
+                                      to_string(totals.count) + " readings, " + to_string(totals.total) + unit + " in total, at most " +
+                                      to_string(totals.max) + unit + " at once\n" +
+                                      "History memory: " + to_string(2 * ConsumptionHistory::memoryBytes()) + " bytes per device\n");
+    }
+
+    void fillWater (const Rest::Request& request, Http::ResponseWriter response) {
+        Device& device = devices.get(deviceId(request));
+        int status;
+        uint64_t lsn;
+        {
+            MeasuredGuard guard(device.lock);
+            status = device.cat.set(Setting::WaterIsRefilled, "");
+            lsn = logDevice(device);
+            deviceChanged(device);
+        }
+        if (!durable(lsn, response))
+            return;
 
         if (status == 1) {
 
@@ -172,18 +1280,23 @@ private:
                         .add<Header::Server>("pistache/0.1")
                         .add<Header::ContentType>(MIME(Text, Plain));
 
-            response.send(Http::Code::Ok, "The water was refilled \n");
+            reply(response, Http::Code::Ok, "The water was refilled \n");
         }
         else {
-            response.send(Http::Code::Not_Found, "Unexpected error");
+            reply(response, Http::Code::Not_Found, "Unexpected error");
         }
     }
 
     void getRecFood(const Rest::Request& request, Http::ResponseWriter response) {
 
-        Guard guard(CatAwayLock);
-
-        string recFoodQuant = cat.get("recFoodG");
+        string id = deviceId(request);
+        Device* device = devices.find(id);
+        if (device == nullptr) {
+            deviceNotFound(id, response);
+            return;
+        }
+        Rcu::ReadSection section;
+        string recFoodQuant = device->settings.read(section)->get(Setting::RecFoodG);
 
         if (recFoodQuant != "") {
 
@@ -192,18 +1305,61 @@ private:
                         .add<Header::Server>("pistache/0.1")
                         .add<Header::ContentType>(MIME(Text, Plain));
 
-            response.send(Http::Code::Ok, "The recommended quantity of food is " + recFoodQuant + " g \n");
+            reply(response, Http::Code::Ok, "The recommended quantity of food is " + recFoodQuant + " g \n");
         }
         else {
-            response.send(Http::Code::Not_Found, "No method defined");
+            reply(response, Http::Code::Not_Found, "No method defined");
         }
 
     }
 
-    void getBreaks(const Rest::Request& request, Http::ResponseWriter response) {
-        Guard guard(CatAwayLock);
+    // Recommended food for a whole fleet: the body has one "<age> <weight>" pair per line,
+    // the response has the quantity in g for each line, in the same order.
+    void getRecFoodBatch(const Rest::Request& request, Http::ResponseWriter response) {
+        vector<float> ages, weights;
+        size_t badLine;
+        bool parsed = forEachTextLine(request.body(), badLine, [&](const char* pos) -> const char* {
+            float age, weight;
+            if (!readDecimal(pos, age) || !readDecimal(pos, weight))
+                return nullptr;
+            ages.push_back(age);
+            weights.push_back(weight);
+            return pos;
+        });
+        if (!parsed) {
+            reply(response, Http::Code::Bad_Request, "Line " + to_string(badLine) + " is not an <age> <weight> pair\n");
+            return;
+        }
+
+        vector<int> grams(ages.size());
+        recommendedFoodG(ages.data(), weights.data(), grams.data(), grams.size());
+
+        string result;
+        result.reserve(grams.size() * 5);
+        for (int g : grams) {
+            result += to_string(g);
+            result += '\n';
+        }
+
+        using namespace Http;
+        response.headers()
+                    .add<Header::Server>("pistache/0.1")
+                    .add<Header::ContentType>(MIME(Text, Plain));
+
+        reply(response, Http::Code::Ok, result);
+    }
 
-        string breaks = cat.get("nrBreaks");
+    void getBreaks(const Rest::Request& request, Http::ResponseWriter response) {
+        string id = deviceId(request);
+        Device* device = devices.find(id);
+        if (device == nullptr) {
+            deviceNotFound(id, response);
+            return;
+        }
+        Rcu::ReadSection section;
+        const SettingsView* settings = device->settings.read(section);
+        string breaks = settings->get(Setting::NrBreaks);
+        string eatingSpeed = settings->get(Setting::EatingSpeed);
 
         if (breaks != "") {
 
@@ -212,17 +1368,22 @@ private:
                         .add<Header::Server>("pistache/0.1")
                         .add<Header::ContentType>(MIME(Text, Plain));
 
-            response.send(Http::Code::Ok, "There are a number of " + breaks + " breaks, according to cat's eating speed (" + globalEatingSpeed + ") \n");
+            reply(response, Http::Code::Ok, "There are a number of " + breaks + " breaks, according to cat's eating speed (" + eatingSpeed + ") \n");
         }
         else {
-            response.send(Http::Code::Not_Found, "No method defined");
+            reply(response, Http::Code::Not_Found, "No method defined");
         }
     }
 
     void getLastRefresh(const Rest::Request& request, Http::ResponseWriter response) {
-        Guard guard(CatAwayLock);
-
-        string lastRefresh = cat.get("waterLastRefreshed");
+        string id = deviceId(request);
+        Device* device = devices.find(id);
+        if (device == nullptr) {
+            deviceNotFound(id, response);
+            return;
+        }
+        Rcu::ReadSection section;
+        string lastRefresh = device->settings.read(section)->get(Setting::WaterLastRefreshed);
 
         if (lastRefresh != "") {
 
@@ -231,10 +1392,10 @@ private:
                         .add<Header::Server>("pistache/0.1")
                         .add<Header::ContentType>(MIME(Text, Plain));
 
-            response.send(Http::Code::Ok, "The water was refreshed at " + lastRefresh + "\n");
+            reply(response, Http::Code::Ok, "The water was refreshed at " + lastRefresh + "\n");
         }
         else {
-            response.send(Http::Code::Not_Found, "No method defined");
+            reply(response, Http::Code::Not_Found, "No method defined");
         }
 
     }
@@ -242,9 +1403,14 @@ private:
     void getCurrentQuantity(const Rest::Request& request, Http::ResponseWriter response) {
         auto optionName = request.param(":option").as<std::string>();
 
-        Guard guard(CatAwayLock);
-
-        string option = cat.get(optionName);
+        string id = deviceId(request);
+        Device* device = devices.find(id);
+        if (device == nullptr) {
+            deviceNotFound(id, response);
+            return;
+        }
+        Rcu::ReadSection section;
+        string option = device->settings.read(section)->get(settingFromName(optionName));
 
         if (option != "") {
 
@@ -253,162 +1419,121 @@ private:
                         .add<Header::Server>("pistache/0.1")
                         .add<Header::ContentType>(MIME(Text, Plain));
 
-            response.send(Http::Code::Ok, "The current quantity of " + optionName + " is " + option + '\n');
+            reply(response, Http::Code::Ok, "The current quantity of " + optionName + " is " + option + '\n');
         }
         else {
-            response.send(Http::Code::Not_Found, "No method defined");
+            reply(response, Http::Code::Not_Found, "No method defined");
         }
 
     }
 
     void getStatus(const Rest::Request& request, Http::ResponseWriter response) {
-        Guard guard(CatAwayLock);
-
-        map<string, string> alerts = cat.getAlerts();
+        string id = deviceId(request);
+        Device* device = devices.find(id);
+        if (device == nullptr) {
+            deviceNotFound(id, response);
+            return;
+        }
+        // The alerts are one atomic word: no lock, and the body was rendered once for every combination of colors
+        AlertState::Snapshot alerts = device->cat.getAlerts();
 
         using namespace Http;
         response.headers()
                     .add<Header::Server>("pistache/0.1")
                     .add<Header::ContentType>(MIME(Text, Plain));
 
-        response.send(Http::Code::Ok, "The water and food tanks color is " + alerts["emptyTank"] + '\n' + 
-                                      "Food expiration date color is " + alerts["expiredFood"] + '\n' + 
-                                      "The water refreshment color is " + alerts["needsRefreshment"] + '\n');
+        reply(response, Http::Code::Ok, statusBodies()[alerts.colors()]);
 
     }
 
-    // Defining the class of the CatAway. It should model the entire configuration of the CatAway
-    class CatAway {
-    public:
-        explicit CatAway() {
-            this->Alert.insert(pair<string, string>("emptyTank", "Green"));
-            this->Alert.insert(pair<string, string>("expiredFood", "Green"));
-            this->Alert.insert(pair<string, string>("needsRefreshment", "Green"));
-         }
-
-        void setRecFood() {
-            if(this->weight == -1.0 || this->age == -1.0)
-            {
-                this->recFoodG = 70;       //portia medie
-                return;
+    static const array<string, 1 << (NrAlerts * AlertState::ColorBits)>& statusBodies() {
+        static const auto bodies = [] {
+            array<string, 1 << (NrAlerts * AlertState::ColorBits)> bodies;
+            for (unsigned colors = 0; colors < bodies.size(); colors++) {
+                AlertState::Snapshot alerts = {colors};
+                bodies[colors] = string("The water and food tanks color is ") + alertColorName(alerts.color(AlertKind::EmptyTank)) + '\n' +
+                                 "Food expiration date color is " + alertColorName(alerts.color(AlertKind::ExpiredFood)) + '\n' +
+                                 "The water refreshment color is " + alertColorName(alerts.color(AlertKind::NeedsRefreshment)) + '\n';
             }
-            float cups = 0;
-            if(this->age > 1.0)
-            {
-                if(this->weight <= 1.8)
-                cups = 0.25;
-                else if(this->weight <= 3.6)
-                cups = 0.5;
-
-                else if(this->weight <= 5.4)
-                cups = 0.75;
-
-                else if(this->weight <= 7.2)
-                cups = 1.0;
-
-                else if(this->weight <= 9.0)
-                cups = 1.25;
-            }
-            else if(this->age >= 0.17 && this->age < 0.42)  //[2, 5) luni
-            {
-                    if(this->weight <= 0.9)
-                cups = 0.5;
-                else if(this->weight <= 1.8)
-                cups = 0.75;
-
-                else if(this->weight <= 2.7)
-                cups = 1.0;
-
-                else if(this->weight <= 3.6)
-                cups = 1.25;
-
-                else if(this->weight <= 4.5)
-                cups = 1.5;
-
-                else if(this->weight <= 5.4)
-                cups = 1.75;
-
-                else if(this->weight <= 6.3)
-                cups = 2.0;
-
-                else if(this->weight <= 8.1)
-                cups = 2.25;
-
-                else if(this->weight <= 9.0)
-                cups = 2.5;
-            }
-            else if(this->age >= 0.42 && this->age < 0.58)  //[5, 7) luni
-            {
-                if(this->weight <= 0.9)
-                cups = 0.25;
-
-                else if(this->weight <= 2.7)
-                cups = 0.5;
-
-                else if(this->weight <= 4.5)
-                cups = 0.75;
+            return bodies;
+        }();
+        return bodies;
+    }
 
-                else if(this->weight <= 6.3)
-                cups = 1.0;
+    // Long poll of the status: answers as soon as the status of the dispenser is newer than :since
+    // (at once if it already is), or after StatusPollSeconds with the same version.
+    // The answer starts with "version <n>": the next poll asks for a status newer than n.
+    void watchStatus(const Rest::Request& request, Http::ResponseWriter response) {
+        string id = deviceId(request);
+        auto sinceText = request.param(":since").as<std::string>();
+        char* end;
+        uint64_t since = strtoull(sinceText.c_str(), &end, 10);
+        if (sinceText.empty() || *end != '\0') {
+            reply(response, Http::Code::Bad_Request, "The version must be a number (0 for the current status)\n");
+            return;
+        }
+        Device* device = devices.find(id);
+        if (device == nullptr) {
+            deviceNotFound(id, response);
+            return;
+        }
 
-                else if(this->weight <= 9.0)
-                cups = 1.25;
+        {
+            lock_guard<mutex> guard(watchersLock);
+            // checked under the lock: the feed takes the watchers under it too, after a new version is published
+            if (device->status.version() <= since) {
+                // measured until the feed answers it, as a 200
+                watchers[device].push_back({since, chrono::steady_clock::now() + chrono::seconds(StatusPollSeconds),
+                                            std::move(response), requestMetrics.defer()});
+                return;
             }
-            else if(this->age >= 0.58 && this->age <= 1.0)  //[7, 12] luni
-            {
-                if(this->weight <= 1.8)
-                    cups = 0.25;
-
-                else if(this->weight <= 4.5)
-                    cups = 0.5;
+        }
+        reply(response, Http::Code::Ok, renderStatus(*device));
+    }
 
-                else if(this->weight <= 7.2)
-                    cups = 0.75;
+    // Defining the class of the CatAway. It should model the entire configuration of the CatAway
+    class CatAway {
+    public:
+        // A simulated dispenser brings its own (manual) clock
+        explicit CatAway(const Clock& clock = dispenserClock)
+            : clock(&clock) {
+         }
 
-                else if(this->weight <= 9.0)
-                    cups = 1.0;
-            }
-        this->recFoodG = 224*cups;   //224 g per cup
+        void setRecFood() {
+            this->recFoodG = recommendedFoodG(this->age, this->weight);
         }
 
         void setBreaks()
         {
-            if(this->eatingSpeed == "slow")
-                this->nrBreaks = 0;
-            else if(this->eatingSpeed == "medium")
-                this->nrBreaks = 1;
-            else if(this->eatingSpeed == "fast")
-                this->nrBreaks = 2;
+            int breaks = nrBreaksFor(this->eatingSpeed);
+            if(breaks >= 0)
+                this->nrBreaks = breaks;
+        }
+
+        // Food left in the tank, in days, split into whole days, hours and minutes, as a time from now
+        time_t refillTime(float days) {
+            float hours = float((days - float(int(days)))*24);
+            float minutes = float((hours - float(int(hours))))*60;
+            return clock->romaniaTime() + int(days) * 86400 + int(hours) * 3600 + int(minutes) * 60;
         }
 
         void setNextFoodRefill()
         {
             if(this->refillFood)
             {
-                time_t now = time(0);
-                tm *gmtm = gmtime(&now);                        //ora dupa UTC (Universal)
-                gmtm->tm_hour += 3;                           //ajustam ora Romaniei  (UTC + 3 ore)
-                this->nextFoodRefill = mktime(gmtm);
-                this->Alert["emptyTank"] = "Yellow";
+                this->nextFoodRefill = clock->romaniaTime();       //ora Romaniei  (UTC + 3 ore)
+                setAlert(AlertKind::EmptyTank, AlertColor::Yellow);
                 return;
             }
             if(!recFoodG) {
                 setRecFood();
             }
             if(feedingSchedule == "") {
-                feedingSchedule = "08:00-19:00-";                                                    //default schedule
+                setFeedingSchedule(DefaultSchedule);                                               //default schedule
             }
             
-            int cantitate = recFoodG * feedingSchedule.length()/6;                                   //pe zi, cantitatea in g
-            float nr_zile = float(this->currentQuantityFoodG/float(cantitate));
-            float nr_ore = float((nr_zile - float(int(nr_zile)))*24);
-            float nr_minute = float((nr_ore - float(int(nr_ore))))*60;
-            time_t now = time(0);
-            tm *gmtm = gmtime(&now);                                                                 //ora dupa UTC (Universal)
-            gmtm->tm_hour += 3 + int(nr_ore);                                                        //ajustam ora Romaniei  (UTC + 3 ore)
-            gmtm->tm_mday += int(nr_zile);
-            gmtm->tm_min += int(nr_minute);
-            time_t possible_time = mktime(gmtm);
+            int cantitate = recFoodG * feedingTimes.count;                                           //pe zi, cantitatea in g
+            time_t possible_time = refillTime(float(this->currentQuantityFoodG/float(cantitate)));
 
             if(foodExpDate != (time_t)(-1)) {
                 double diff = difftime(possible_time, this->foodExpDate);
@@ -422,30 +1547,14 @@ private:
             }
         }
 
-
-    
-
+        // The food is expired from the day after its expiration date
         bool Expired() {
             if(foodExpDate == (time_t)(-1))
                 return false;
-            
-            time_t now = time(0);
-            tm local_tm = *localtime(&now);
-            tm exp_date = *localtime(&foodExpDate);
 
-            if(local_tm.tm_year > exp_date.tm_year){
-                this->Alert["expiredFood"] = "Red";
+            if(clock->time() >= foodExpiresAt){
+                setAlert(AlertKind::ExpiredFood, AlertColor::Red);
                 return true;
-            }else if(local_tm.tm_year == exp_date.tm_year){
-                if(local_tm.tm_mon > exp_date.tm_mon){
-                    this->Alert["expiredFood"] = "Red";
-                    return true;
-                }else if(local_tm.tm_mon == exp_date.tm_mon){
-                    if(local_tm.tm_mday < exp_date.tm_mday){
-                        this->Alert["expiredFood"] = "Red";
-                        return true;
-                    }
-                }
             }
             return false;
         }
@@ -453,52 +1562,67 @@ private:
         void setWaterRefresh() {
             if(this->waterLastRefreshed == (time_t)(-1))
             {
-                this->Alert["needsRefreshment"] = "Orange";
+                setAlert(AlertKind::NeedsRefreshment, AlertColor::Orange);
                 return;
             }
-            time_t now = time(0);
-            tm *gmtm = gmtime(&now);
-            gmtm->tm_hour += 3;      //ora Romaniei, prezent
-            now = mktime(gmtm);
-            string prima_h;
-            string doi_h;
-            if(this->waterRefSchedule.length() >= 13)
-            {
-                prima_h = this->waterRefSchedule.substr(0, 5);
-                doi_h = this->waterRefSchedule.substr(7, 5);
-            }
-            else
-            {
-                prima_h = "08:00";
-                doi_h = "19:00";
-            }
-            const char* str1 = prima_h.c_str();
-            const char* str2 = doi_h.c_str();
-
-            struct tm tm_;
-            struct tm tm__;
-            strptime(str1, "%H:%M:%S", &tm_);
-            time_t t1 = mktime(&tm_);  
+            time_t now = clock->romaniaTime();      //ora Romaniei, prezent
 
-            strptime(str2, "%H:%M:%S", &tm__);
-            time_t t2 = mktime(&tm__); 
-
-            double diferenta = difftime(t2, t1);
+            double diferenta = refreshWindowSeconds();
 
             double diferenta2 = difftime(now, this->waterLastRefreshed);
             if(diferenta2>diferenta)
-                this->Alert["needsRefreshment"] = "Orange";
+                setAlert(AlertKind::NeedsRefreshment, AlertColor::Orange);
+        }
+
+        // The water has to be refreshed between the first two times of the schedule
+        int refreshWindowSeconds() const {
+            int firstMinute = 8 * 60, secondMinute = 19 * 60;
+            if(waterRefreshTimes.count >= 2)
+            {
+                firstMinute = waterRefreshTimes.minutes[0];
+                secondMinute = waterRefreshTimes.minutes[1];
+            }
+            return (secondMinute - firstMinute) * 60;
+        }
+
+        // The next moment (clock->time()) an alert can change without a request: the food expires,
+        // the water is due for a refreshment or a tank is predicted empty. -1 when there is none.
+        time_t nextAlertCheck() const {
+            AlertState::Snapshot current = alerts.load();
+            time_t next = (time_t)(-1);
+            auto earliest = [&next](time_t at) {
+                if (at != (time_t)(-1) && (next == (time_t)(-1) || at < next))
+                    next = at;
+            };
+            if (foodExpDate != (time_t)(-1) && current.color(AlertKind::ExpiredFood) != AlertColor::Red)
+                earliest(foodExpiresAt);
+            if (waterLastRefreshed != (time_t)(-1) && current.color(AlertKind::NeedsRefreshment) != AlertColor::Orange)
+                earliest(clock->fromRomaniaTime(waterLastRefreshed + refreshWindowSeconds() + 1));
+            if (current.color(AlertKind::EmptyTank) != AlertColor::Yellow) {
+                if (nextFoodRefill != (time_t)(-1))
+                    earliest(clock->fromRomaniaTime(nextFoodRefill));
+                if (nextWaterRefill != (time_t)(-1))
+                    earliest(clock->fromRomaniaTime(nextWaterRefill));
+            }
+            return next;
+        }
+
+        // Updates the alerts that depend on the time alone (the timer of the dispenser went off)
+        void checkAlerts() {
+            Expired();
+            if (waterLastRefreshed != (time_t)(-1))
+                setWaterRefresh();
+            time_t now = clock->romaniaTime();
+            if ((nextFoodRefill != (time_t)(-1) && now >= nextFoodRefill) || (nextWaterRefill != (time_t)(-1) && now >= nextWaterRefill))
+                setAlert(AlertKind::EmptyTank, AlertColor::Yellow);
         }
 
         void setNextWaterRefill()
         {
             if(this->emptyWaterTank == true)
             {
-                this->Alert["emptyTank"] = "Yellow";
-                time_t now = time(0);
-                tm *gmtm = gmtime(&now);                                          //ora UTC
-                gmtm->tm_hour += 3;                                              //ora Romaniei
-                this->nextWaterRefill = mktime(gmtm);
+                setAlert(AlertKind::EmptyTank, AlertColor::Yellow);
+                this->nextWaterRefill = clock->romaniaTime();     //ora Romaniei
                 return;
             }
             if(this->waterBowlCapacityMl == -1)
@@ -506,227 +1630,418 @@ private:
 
             if(this->waterRefSchedule == "")
             {
-                this->waterRefSchedule = "08:00-19:00-";
+                setWaterRefSchedule(DefaultSchedule);
+            }
+
+            int cantitate = this->waterBowlCapacityMl * waterRefreshTimes.count;                     //pe zi, cantitatea in g
+            this->nextWaterRefill = refillTime(float(this->currentQuantityWaterMl/float(cantitate)));
+        }
+
+        void setFeedingSchedule(const string& schedule) {
+            feedingSchedule = schedule;
+            feedingTimes = Schedule::parse(schedule);
+        }
+
+        void setWaterRefSchedule(const string& schedule) {
+            waterRefSchedule = schedule;
+            waterRefreshTimes = Schedule::parse(schedule);
+        }
+
+        void setFoodExpDate(time_t date) {
+            foodExpDate = date;
+            tm expDay;
+            localtime_r(&date, &expDay);
+            expDay.tm_mday += 1;
+            expDay.tm_hour = expDay.tm_min = expDay.tm_sec = 0;
+            expDay.tm_isdst = -1;
+            foodExpiresAt = mktime(&expDay);
+        }
+
+
+        // Takes the water out of the tank; the caller predicts the next refill
+        void consumeWater(int ml, time_t at) {
+            lastConsumedWater = ml;
+            waterHistory.record(at, ml);
+            if(lastConsumedWater <= this->currentQuantityWaterMl){
+                this->currentQuantityWaterMl -= lastConsumedWater;
+            } else {
+                this->currentQuantityWaterMl = 0;
+                this->emptyWaterTank = true;
+                setAlert(AlertKind::EmptyTank, AlertColor::Yellow);
             }
+        }
 
-            int cantitate = this->waterBowlCapacityMl * waterRefSchedule.length()/6;                                   //pe zi, cantitatea in g
-            float nr_zile = float(this->currentQuantityFoodG/float(cantitate));
-            float nr_ore = float((nr_zile - float(int(nr_zile)))*24);
-            float nr_minute = float((nr_ore - float(int(nr_ore))))*60;
-            time_t now = time(0);
-            tm *gmtm = gmtime(&now);                                                                 //ora dupa UTC (Universal)
-            gmtm->tm_hour += 3 + int(nr_ore);                                                        //ajustam ora Romaniei  (UTC + 3 ore)
-            gmtm->tm_mday += int(nr_zile);
-            gmtm->tm_min += int(nr_minute);
-            this->nextWaterRefill = mktime(gmtm);
+        // Takes the food out of the tank; the caller predicts the next refill
+        void consumeFood(int g, time_t at) {
+            lastConsumedFood = g;
+            foodHistory.record(at, g);
+            if(!this->Expired()) {
+                if(lastConsumedFood <= this->currentQuantityFoodG){
+                    this->currentQuantityFoodG -= lastConsumedFood;
+                } else {
+                    this->currentQuantityFoodG = 0;
+                    this->emptyFoodTank = true;
+                    this->refillFood = true;
+                    setAlert(AlertKind::EmptyTank, AlertColor::Yellow);
+                }
+            } else {
+                this->refillFood = true;
+                this->expiredFood = true;
+                setAlert(AlertKind::ExpiredFood, AlertColor::Red);
+            }
+        }
+
+        // Applies a batch of consumption events (already in time order), then predicts the refills once
+        void consume(const vector<ConsumptionEvent>& events) {
+            bool food = false, water = false;
+            for (const ConsumptionEvent& event : events) {
+                if (event.kind == ConsumptionEvent::Food) {
+                    consumeFood(event.amount, event.time);
+                    food = true;
+                } else {
+                    consumeWater(event.amount, event.time);
+                    water = true;
+                }
+            }
+            if (food)
+                this->setNextFoodRefill();
+            if (water)
+                this->setNextWaterRefill();
         }
 
+        // Setting the value for one of the settings, by route name
+        int set(string_view name, const string& value) {
+            return set(settingFromName(name), value);
+        }
 
         // Setting the value for one of the settings. Hardcoded for the defrosting option
-        int set(std::string name, std::string value) {
-            struct tm tm_;
-            if(name == "weight") {
-                weight = stof(value);
-                globalWeight = weight;
-                this->setRecFood();
-                return 1;
-            } else if (name == "age") {
-                age = stof(value);
-                globalAge = age;
-                this->setRecFood();
-                return 1;
-            } else if (name == "eatingSpeed") {
+        int set(Setting setting, const string& value) {
+            struct tm tm_ = {};
+            switch (setting) {
+            case Setting::Weight:
+            case Setting::Age:
+                return setNumber(setting, stof(value));
+            case Setting::WaterBowlCapacityMl:
+            case Setting::LastConsumedWater:
+            case Setting::LastConsumedFood:
+                return setNumber(setting, stoi(value));
+            case Setting::EmptyFoodTank:
+            case Setting::EmptyWaterTank:
+                return setNumber(setting, value == "1");
+            case Setting::FoodIsRefilled:
+            case Setting::WaterIsRefilled:
+            case Setting::WaterIsRefreshed:
+                return setNumber(setting, value == "true");
+            case Setting::EatingSpeed:
                 eatingSpeed = value;
-                globalEatingSpeed = eatingSpeed;
                 this->setBreaks();
                 return 1;
-            } else if (name == "waterBowlWeightG"){
-                waterBowlCapacityMl = stoi(value);
+            case Setting::FeedingSchedule:
+                setFeedingSchedule(value);
                 return 1;
-            } else if (name == "waterRefSchedule"){
-                waterRefSchedule = value;
+            case Setting::WaterRefSchedule:
+                setWaterRefSchedule(value);
                 return 1;
-            } else if (name == "foodExpDate"){
+            case Setting::FoodExpDate:
                 strptime(value.c_str(), "%d.%m.%Y %H:%M", &tm_);
-                foodExpDate = mktime(&tm_);
+                setFoodExpDate(mktime(&tm_));
                 this->setNextFoodRefill();
                 return 1;
-            } else if (name == "emptyFoodTank"){
-                emptyFoodTank = (value == "1");
+            case Setting::BreakDuration:
+                return breakDuration;
+            case Setting::WaterLastRefreshed:
+                strptime(value.c_str(), "%d.%m.%Y %H:%M", &tm_);
+                waterLastRefreshed = mktime(&tm_);
+                this->setWaterRefresh();
+                return 1;
+            default:
+                return 0;
+            }
+        }
+
+        // Setting a number, or a flag as 0/1, already decoded (the binary telemetry sends them so)
+        int setNumber(Setting setting, double value) {
+            switch (setting) {
+            case Setting::Weight:
+                weight = value;
+                this->setRecFood();
+                return 1;
+            case Setting::Age:
+                age = value;
+                this->setRecFood();
+                return 1;
+            case Setting::WaterBowlCapacityMl:
+                waterBowlCapacityMl = static_cast<int>(value);
+                return 1;
+            case Setting::EmptyFoodTank:
+                emptyFoodTank = (value != 0);
                 if(emptyFoodTank == true)
                 {
                     this->refillFood = true;
-                    this->Alert["emptyTank"] = "Yellow";
+                    setAlert(AlertKind::EmptyTank, AlertColor::Yellow);
                     this->setNextFoodRefill();
                 }
                 return 1;
-            } else if (name == "emptyWaterTank"){
-                emptyWaterTank = (value == "1");
+            case Setting::EmptyWaterTank:
+                emptyWaterTank = (value != 0);
                 if(emptyWaterTank == true)
                 {
-                    this->Alert["emptyTank"] = "Yellow";
+                    setAlert(AlertKind::EmptyTank, AlertColor::Yellow);
                     this->setNextWaterRefill();
                 }
                 return 1;
-            } else if (name == "lastConsumedWater"){
-                lastConsumedWater = stoi(value);
-                if(lastConsumedWater <= this->currentQuantityWaterMl){
-                    this->currentQuantityWaterMl -= lastConsumedWater;
-                    this->setNextWaterRefill();
-                } else {
-                    this->currentQuantityWaterMl = 0;
-                    this->emptyWaterTank = true;
-                    this->Alert["emptyTank"] = "Yellow";
-                    this->setNextWaterRefill();
-                }
+            case Setting::LastConsumedWater:
+                consumeWater(static_cast<int>(value), clock->time());
+                this->setNextWaterRefill();
                 return 1;
-            } else if (name == "lastConsumedFood"){
-                lastConsumedFood = stoi(value);
-                if(!this->Expired()) {
-                    if(lastConsumedWater <= this->currentQuantityFoodG){
-                        this->currentQuantityFoodG -= lastConsumedFood;
-                        this->setNextFoodRefill();
-                    } else {
-                    this->currentQuantityFoodG = 0;
-                    this->emptyFoodTank = true;
-                    this->refillFood = true;
-                    this->Alert["emptyTank"] = "Yellow";
-                    this->setNextFoodRefill();
-                    } 
-                } else {
-                    this->refillFood = true;
-                    this->expiredFood = true;
-                    this->Alert["expiredFood"] = "Red";
-                    this->setNextFoodRefill();
-                }
+            case Setting::LastConsumedFood:
+                consumeFood(static_cast<int>(value), clock->time());
+                this->setNextFoodRefill();
                 return 1;
-            } 
-            else if(name == "foodIsRefilled")
-            {
-                this->foodIsRefilled = (value == "true");
-                if(foodIsRefilled)
+            case Setting::FoodIsRefilled:
+                this->foodIsRefilled = (value != 0);
+                if(foodIsRefilled) {
                     this->currentQuantityFoodG = tankSizeFoodG;
+                    this->emptyFoodTank = false;
+                    this->refillFood = false;
+                }
                 this->foodIsRefilled = false;
                 if(!this->emptyWaterTank)
-                    this->Alert["emptyTank"] = "Green";
+                    setAlert(AlertKind::EmptyTank, AlertColor::Green);
 
-                this->Alert["expiredFood"] = "Green";
-            }
-            else if(name == "waterIsRefilled")
-            {
-                this->waterIsRefilled = (value == "true");
-                time_t now = time(0);
-                tm *gmtm = gmtime(&now);                          
-                gmtm->tm_hour += 3;                                              
-                this->waterLastRefreshed = mktime(gmtm);
+                setAlert(AlertKind::ExpiredFood, AlertColor::Green);
+                this->setNextFoodRefill();
+                return 0;
+            case Setting::WaterIsRefilled:
+                this->waterIsRefilled = (value != 0);
+                this->waterLastRefreshed = clock->romaniaTime();
 
-                if(waterIsRefilled)
+                if(waterIsRefilled) {
                     this->currentQuantityWaterMl = tankSizeWaterMl;
+                    this->emptyWaterTank = false;
+                }
                 this->waterIsRefilled = false;
                 if(!this->emptyFoodTank)
-                    this->Alert["emptyTank"] = "Green";
+                    setAlert(AlertKind::EmptyTank, AlertColor::Green);
+                this->setNextWaterRefill();
                 return 1;
-            }
-            else if(name == "breakDuration"){ 
+            case Setting::BreakDuration:
                 return breakDuration;
-                }
-            else if(name == "waterLastRefreshed")
-            {
-                strptime(value.c_str(), "%d.%m.%Y %H:%M", &tm_);
-                waterLastRefreshed = mktime(&tm_);
-                this->setWaterRefresh();
-                return 1;
-            }
-            else if(name == "waterIsRefreshed")
-            {
-                this->waterIsRefreshed = (value == "true");
+            case Setting::WaterIsRefreshed:
+                this->waterIsRefreshed = (value != 0);
                 if(waterIsRefreshed){
-                    this->Alert["needsRefreshment"] = "Green";
+                    setAlert(AlertKind::NeedsRefreshment, AlertColor::Green);
                     this->waterIsRefilled = false;
                 }
+                return 0;
+            default:
+                return 0;
             }
-            return 0;
         }
 
-        // Getter
-        string get(std::string name){
-            struct tm *tm_;
-            char* dt;
-            if(name == "weight") {
-                return to_string(weight);
-            } else if (name == "age") {
-                return to_string(age);
-            } else if (name == "eatingSpeed") {
-                return eatingSpeed;
-            } else if (name == "feedingSchedule"){
-                return feedingSchedule;
-            } else if (name == "waterBowlCapacityMl"){
-                return to_string(waterBowlCapacityMl);
-            } else if (name == "waterRefSchedule"){
-                return waterRefSchedule;
-            } else if (name == "foodExpDate"){
-                dt = ctime(&foodExpDate);
-                string someString(dt);
-                return someString;
-            } else if (name == "emptyFoodTank"){
-                return emptyFoodTank ? "true" : "false";
-            } else if (name == "emptyWaterTank"){
-                return emptyWaterTank ? "true" : "false";
-            } else if (name == "recFoodG"){
-                return to_string(recFoodG);
-            } else if (name == "nrBreaks"){
-                return to_string(nrBreaks);
-            }   else if (name == "currentQuantityWaterMl"){
-                return to_string(currentQuantityWaterMl);
-            }   else if (name == "refreshWater"){
-                return refreshWater ? "true" : "false";
-            }   else if (name == "currentQuantityFoodG"){
-                return to_string(currentQuantityFoodG);
-            }   else if (name == "refillFood"){
-                return refillFood ? "true" : "false";
-            }   else if (name == "nextFoodRefill"){
-                dt = ctime(&nextFoodRefill);
-                string someString(dt);
-                return someString;
-            }   else if (name == "nextWaterRefill"){
-                dt = ctime(&nextWaterRefill);
-                string someString(dt);
-                return someString;
-            }   else if (name == "lastConsumedWater"){
-                return to_string(lastConsumedWater);
-            }   else if (name == "lastConsumedFood"){
-                return to_string(lastConsumedFood);
-            }   else if(name == "tankSizeFoodG"){
-                return to_string(tankSizeFoodG);
-            }   else if(name == "tankSizeWaterMl"){
-                return to_string(tankSizeWaterMl);
-            }   else if(name == "breakDuration"){
-                return to_string(breakDuration);
-            }   else if(name == "waterLastRefreshed"){
-                dt = ctime(&waterLastRefreshed);
-                string someString(dt);
-                return someString;
-            } 
-            return 0;
+        // Getter, by route name
+        string get(string_view name) {
+            return get(settingFromName(name));
+        }
+
+        // Getter; an empty string means the setting does not exist
+        string get(Setting setting) const {
+            return value(setting).render();
         }
 
-    map<string, string> getAlerts() {
-        return this->Alert;
+        SettingValue value(Setting setting) const {
+            using Kind = SettingValue::Kind;
+            auto integer = [](Kind kind, int64_t value) { SettingValue v; v.kind = kind; v.integer = value; return v; };
+            auto decimal = [](double value) { SettingValue v; v.kind = Kind::Decimal; v.decimal = value; return v; };
+            auto text = [](const string& value) { SettingValue v; v.kind = Kind::Text; v.text = value; return v; };
+            switch (setting) {
+            case Setting::Weight:                 return decimal(weight);
+            case Setting::Age:                    return decimal(age);
+            case Setting::EatingSpeed:            return text(eatingSpeed);
+            case Setting::FeedingSchedule:        return text(feedingSchedule);
+            case Setting::WaterBowlCapacityMl:    return integer(Kind::Integer, waterBowlCapacityMl);
+            case Setting::WaterRefSchedule:       return text(waterRefSchedule);
+            case Setting::FoodExpDate:            return integer(Kind::Time, foodExpDate);
+            case Setting::EmptyFoodTank:          return integer(Kind::Flag, emptyFoodTank);
+            case Setting::EmptyWaterTank:         return integer(Kind::Flag, emptyWaterTank);
+            case Setting::RecFoodG:               return integer(Kind::Integer, recFoodG);
+            case Setting::NrBreaks:               return integer(Kind::Integer, nrBreaks);
+            case Setting::CurrentQuantityWaterMl: return integer(Kind::Integer, currentQuantityWaterMl);
+            case Setting::RefreshWater:           return integer(Kind::Flag, refreshWater);
+            case Setting::CurrentQuantityFoodG:   return integer(Kind::Integer, currentQuantityFoodG);
+            case Setting::RefillFood:             return integer(Kind::Flag, refillFood);
+            case Setting::NextFoodRefill:         return integer(Kind::Time, nextFoodRefill);
+            case Setting::NextWaterRefill:        return integer(Kind::Time, nextWaterRefill);
+            case Setting::LastConsumedWater:      return integer(Kind::Integer, lastConsumedWater);
+            case Setting::LastConsumedFood:       return integer(Kind::Integer, lastConsumedFood);
+            case Setting::TankSizeFoodG:          return integer(Kind::Integer, tankSizeFoodG);
+            case Setting::TankSizeWaterMl:        return integer(Kind::Integer, tankSizeWaterMl);
+            case Setting::BreakDuration:          return integer(Kind::Integer, breakDuration);
+            case Setting::WaterLastRefreshed:     return integer(Kind::Time, waterLastRefreshed);
+            default:                              return SettingValue();
+            }
+        }
+
+        // Every setting, for the GET routes
+        unique_ptr<const SettingsView> getSettingsView() const {
+            auto view = make_unique<SettingsView>();
+            for (size_t setting = 0; setting < view->values.size(); setting++)
+                view->values[setting] = value(static_cast<Setting>(setting));
+            return view;
+        }
+
+    // When the tank is predicted to need a refill, in the dispenser's time; -1 when not predicted yet
+    time_t predictedRefill(ConsumptionEvent::Kind kind) const {
+        return kind == ConsumptionEvent::Food ? nextFoodRefill : nextWaterRefill;
+    }
+
+    // Can be called without the lock of the dispenser
+    AlertState::Snapshot getAlerts() const {
+        return alerts.load();
+    }
+
+    DispenserStatus getStatus() const {
+        DispenserStatus status;
+        status.alerts = alerts.load().word;
+        status.foodG = currentQuantityFoodG;
+        status.waterMl = currentQuantityWaterMl;
+        return status;
+    }
+
+    PublishedState getPublishedState() const {
+        PublishedState state;
+        state.weight = weight;
+        state.age = age;
+        strncpy(state.eatingSpeed, eatingSpeed.c_str(), sizeof(state.eatingSpeed) - 1);
+        state.status = getStatus();
+        return state;
+    }
+
+    // Binary image of the state, for the write-ahead log and the snapshots (the history is not kept)
+    void save(RecordWriter& out) const {
+        out.put(weight);
+        out.put(age);
+        out.putString(eatingSpeed);
+        out.putString(feedingSchedule);
+        out.put(waterBowlCapacityMl);
+        out.putString(waterRefSchedule);
+        out.put(static_cast<int64_t>(foodExpDate));
+        out.put(emptyFoodTank);
+        out.put(emptyWaterTank);
+        out.put(expiredFood);
+        out.put(recFoodG);
+        out.put(nrBreaks);
+        out.put(breakDuration);
+        out.put(currentQuantityWaterMl);
+        out.put(refreshWater);
+        out.put(static_cast<int64_t>(waterLastRefreshed));
+        out.put(currentQuantityFoodG);
+        out.put(refillFood);
+        out.put(static_cast<int64_t>(nextFoodRefill));
+        out.put(static_cast<int64_t>(nextWaterRefill));
+        out.put(lastConsumedWater);
+        out.put(lastConsumedFood);
+        AlertState::Snapshot snapshot = alerts.load();
+        for (int alert = 0; alert < NrAlerts; alert++)
+            out.putString(alertColorName(snapshot.color(static_cast<AlertKind>(alert))));
+    }
+
+    // Decoded in full before anything is applied: a short record leaves the dispenser as it was
+    bool load(RecordReader& in) {
+        struct {
+            float weight = -1, age = -1;
+            string eatingSpeed, feeding, waterSchedule;
+            int waterBowlCapacityMl = -1, recFoodG = -1, nrBreaks = 0, breakDuration = -1;
+            int currentQuantityWaterMl = 0, currentQuantityFoodG = 0, lastConsumedWater = 0, lastConsumedFood = 0;
+            bool emptyFoodTank = false, emptyWaterTank = false, expiredFood = false, refreshWater = false, refillFood = false;
+            int64_t expDate = -1, lastRefreshed = -1, foodRefill = -1, waterRefill = -1;
+            AlertColor colors[NrAlerts] = {};
+        } image;
+        in.get(image.weight);
+        in.get(image.age);
+        in.getString(image.eatingSpeed);
+        in.getString(image.feeding);
+        in.get(image.waterBowlCapacityMl);
+        in.getString(image.waterSchedule);
+        in.get(image.expDate);
+        in.get(image.emptyFoodTank);
+        in.get(image.emptyWaterTank);
+        in.get(image.expiredFood);
+        in.get(image.recFoodG);
+        in.get(image.nrBreaks);
+        in.get(image.breakDuration);
+        in.get(image.currentQuantityWaterMl);
+        in.get(image.refreshWater);
+        in.get(image.lastRefreshed);
+        in.get(image.currentQuantityFoodG);
+        in.get(image.refillFood);
+        in.get(image.foodRefill);
+        in.get(image.waterRefill);
+        in.get(image.lastConsumedWater);
+        in.get(image.lastConsumedFood);
+        for (int alert = 0; alert < NrAlerts; alert++) {
+            string color;
+            in.getString(color);
+            image.colors[alert] = alertColorFromName(color.c_str());
+        }
+        if (!in.ok())
+            return false;
+
+        weight = image.weight;
+        age = image.age;
+        eatingSpeed = image.eatingSpeed;
+        waterBowlCapacityMl = image.waterBowlCapacityMl;
+        emptyFoodTank = image.emptyFoodTank;
+        emptyWaterTank = image.emptyWaterTank;
+        expiredFood = image.expiredFood;
+        recFoodG = image.recFoodG;
+        nrBreaks = image.nrBreaks;
+        breakDuration = image.breakDuration;
+        currentQuantityWaterMl = image.currentQuantityWaterMl;
+        refreshWater = image.refreshWater;
+        currentQuantityFoodG = image.currentQuantityFoodG;
+        refillFood = image.refillFood;
+        lastConsumedWater = image.lastConsumedWater;
+        lastConsumedFood = image.lastConsumedFood;
+        for (int alert = 0; alert < NrAlerts; alert++)
+            alerts.set(static_cast<AlertKind>(alert), image.colors[alert]);
+
+        setFeedingSchedule(image.feeding);
+        setWaterRefSchedule(image.waterSchedule);
+        if (image.expDate == -1)
+            foodExpDate = foodExpiresAt = (time_t)(-1);
+        else
+            setFoodExpDate(static_cast<time_t>(image.expDate));
+        waterLastRefreshed = static_cast<time_t>(image.lastRefreshed);
+        nextFoodRefill = static_cast<time_t>(image.foodRefill);
+        nextWaterRefill = static_cast<time_t>(image.waterRefill);
+        return true;
+    }
+
+    const ConsumptionHistory& getHistory(ConsumptionEvent::Kind kind) const {
+        return kind == ConsumptionEvent::Food ? foodHistory : waterHistory;
     }
 
     private:
+        void setAlert(AlertKind alert, AlertColor color) {
+            alerts.set(alert, color);
+        }
+
        float weight = -1.0; 
        float age = -1.0;
        string eatingSpeed;
        string feedingSchedule = "";
+       Schedule feedingTimes;                                 //feedingSchedule, parsed
        int waterBowlCapacityMl = -1;  //water bowl capacity in ml
        string waterRefSchedule = "";   //water refreshment schedule
+       Schedule waterRefreshTimes;                            //waterRefSchedule, parsed
        time_t foodExpDate = (time_t) (-1);
-       bool emptyFoodTank;
-       bool emptyWaterTank;
+       time_t foodExpiresAt = (time_t) (-1);                  //start of the day after foodExpDate
+       bool emptyFoodTank = false;
+       bool emptyWaterTank = false;
        bool expiredFood = false;
        int recFoodG = -1;                                      //recommended quantity of food in g
-       int nrBreaks;                                        //number of breaks
+       int nrBreaks = 0;                                    //number of breaks
        int breakDuration = -1;                                //duration in minutes
        int currentQuantityWaterMl = 0;                       //quantity of water in tank in ml
        bool refreshWater = false;                                   //true if needs to be refreshed
@@ -736,90 +2051,1085 @@ private:
        bool foodIsRefilled = false;                           //true if user refilled food
        bool waterIsRefilled = false;                          //true if user refilled water
        bool waterIsRefreshed = false;
-       time_t nextFoodRefill;
-       time_t nextWaterRefill;
+       time_t nextFoodRefill = (time_t)(-1);
+       time_t nextWaterRefill = (time_t)(-1);
        const int tankSizeFoodG = 1000;                       //in g
        const int tankSizeWaterMl = 3000;                      //in ml
-       int lastConsumedWater;                                 //in ml
-       int lastConsumedFood;                                 //in g
-       map<string,string> Alert; 
+       int lastConsumedWater = 0;                             //in ml
+       int lastConsumedFood = 0;                             //in g
+       AlertState alerts;
+       ConsumptionHistory foodHistory;                        //what was eaten, in g
+       ConsumptionHistory waterHistory;                       //what was drunk, in ml
+       const Clock* clock;
     };
 
     // Stateful App
     // Setăm Dispenser-ul pentru pisicile care îl vor folosi (save "users")
     void setCatDetails(const Rest::Request& request, Http::ResponseWriter response) {
-        Cat* ourCat;
         auto name = request.param(":name").as<std::string>();
         auto age = request.param(":age").as<std::string>();
         auto weight = request.param(":weight").as<std::string>();
         auto eatingSpeed = request.param(":eatingSpeed").as<std::string>();
 
-        // ca să verificăm dacă pisi există deja
-        bool found = false;
-        for(Cat* &catAux: saved_Cats) {
-            if(catAux->name == name)
-            {
-                found = true;  // numele este unic pentru pisi (identificator); dacă avem acelasi nume, este update
-                ourCat = catAux;
-            }
-        }
-
-        if(!found)  // dacă nu avem pisică, o adăugăm
-        {
-            ourCat = new Cat();
-            saved_Cats.push_back(ourCat);
-        }
-
-        // Actualizăm / Punem info despre pisi
-        ourCat->name = name;
-        ourCat->age = stof(age);
-        ourCat->weight = stof(weight);
-        ourCat->eatingSpeed = eatingSpeed;
         string feedingSchedule = "08:00-19:00-";
         if(request.hasParam(":feedingSchedule")) {
             auto value = request.param(":feedingSchedule");
             feedingSchedule = value.as<string>();
         }
-        ourCat->feedingSchedule = feedingSchedule;
 
+        // Verificăm valorile după regulile din buffers.json, înainte de stof
+        if (!Validators::matches(Validators::age, age) || !Validators::matches(Validators::weight, weight) ||
+            !Validators::matches(Validators::eatingSpeed, eatingSpeed) ||
+            !Validators::matches(Validators::feedingSchedule, feedingSchedule)) {
+            reply(response, Http::Code::Bad_Request, "Invalid cat details: age and weight are numbers, eatingSpeed is "
+                  "fast, medium or slow and feedingSchedule is like 08:00-19:00-\n");
+            return;
+        }
+
+        // Punem info despre pisi; profilul e construit în afara registrului
+        Cat ourCat;
+        ourCat.name = name;
+        ourCat.age = stof(age);
+        ourCat.weight = stof(weight);
+        ourCat.eatingSpeed = eatingSpeed;
+        ourCat.feedingSchedule = feedingSchedule;
+        ourCat.recFoodG = recommendedFoodG(ourCat.age, ourCat.weight);
+        ourCat.nrBreaks = nrBreaksFor(ourCat.eatingSpeed);
+
+        // numele este unic pentru pisi (identificator); dacă avem acelasi nume, este update
+        RecordWriter record;
+        saveCat(record, ourCat);
+        CatProfile profile = ourCat;
+        CatAwayEndpoint& owner = catOwner(profile.name);
+        uint64_t lsn = owner.saved_Cats.save(&profile, 1, [&](size_t) { return owner.wal.append(CatRecord, record.data()); });
+        if (!owner.durable(lsn, response))
+            return;
+
+        reply(response, Http::Code::Ok, "Cat Info Saved! Meow! \n");
+    }
+
+    // Onboarding of a whole fleet: one {"name":"Tom","age":3.5,"weight":4.2,"eatingSpeed":"slow",
+    // "feedingSchedule":"08:00-19:00-"} per line (feedingSchedule may be left out, other keys are ignored, so
+    // the lines of GET /cats/export are taken back). The lines are read in place and all of them are checked
+    // before anything is saved; every cat goes to the core owning it (catOwner), where its derived fields
+    // are computed ImportBatch cats at a time, each batch is logged and goes into the registry under one
+    // lock, and the import waits once for the log of each core.
+    void importCats(const Rest::Request& request, Http::ResponseWriter response) {
+        const string& body = request.body();
+        vector<CatProfile> cats;
+        deque<string> unescaped;            // the few strings with escapes; the other views are into the body
+        const char* problem = nullptr;
+        size_t badLine = 0;
+        Ndjson::forEachLine(body, [&](string_view line, size_t lineNumber) {
+            CatProfile cat;
+            problem = parseCatLine(line, cat, unescaped);
+            if (problem != nullptr) {
+                badLine = lineNumber;
+                return false;
+            }
+            cats.push_back(cat);
+            return true;
+        });
+        if (problem != nullptr) {
+            reply(response, Http::Code::Bad_Request, "Line " + to_string(badLine) + ": " + problem + "; no cat was imported\n");
+            return;
+        }
+
+        // The lines keep their order within a core, so the last of a repeated name wins
+        vector<CatAwayEndpoint*> owners = catOwners();
+        vector<vector<CatProfile>> byOwner(owners.size());
+        if (owners.size() == 1)
+            byOwner[0] = std::move(cats);
+        else
+            for (const CatProfile& cat : cats)
+                byOwner[partitionOf(cat.name, owners.size())].push_back(cat);
+        size_t imported = 0;
+        vector<uint64_t> lsns(owners.size());
+        for (size_t owner = 0; owner < owners.size(); owner++) {
+            lsns[owner] = owners[owner]->importInto(byOwner[owner].data(), byOwner[owner].size());
+            imported += byOwner[owner].size();
+        }
+        for (size_t owner = 0; owner < owners.size(); owner++)
+            if (!owners[owner]->durable(lsns[owner], response))
+                return;
+
+        reply(response, Http::Code::Ok, to_string(imported) + " cats were imported\n");
+    }
 
-        CatAway catAway;
-        catAway.set("age", to_string(ourCat->age));
-        catAway.set("weight", to_string(ourCat->weight));
-        catAway.set("eatingSpeed", ourCat->eatingSpeed);
-        catAway.set("feedingSchedule", ourCat->feedingSchedule);
-        catAway.setRecFood(); ourCat->recFoodG = stoi(catAway.get("recFoodG"));
-        catAway.setBreaks(); ourCat->nrBreaks = stoi(catAway.get("nrBreaks"));
+    // Saves the cats into this endpoint's registry and log; returns the lsn to wait for
+    uint64_t importInto(CatProfile* cats, size_t size) {
+        float ages[ImportBatch], weights[ImportBatch];
+        int grams[ImportBatch];
+        RecordWriter records[ImportBatch];
+        uint64_t lsn = 0;
+        for (size_t first = 0; first < size; first += ImportBatch) {
+            size_t count = min(ImportBatch, size - first);
+            CatProfile* batch = cats + first;
+            for (size_t i = 0; i < count; i++) {
+                ages[i] = batch[i].age;
+                weights[i] = batch[i].weight;
+            }
+            recommendedFoodG(ages, weights, grams, count);
+            for (size_t i = 0; i < count; i++) {
+                batch[i].recFoodG = grams[i];
+                batch[i].nrBreaks = nrBreaksFor(batch[i].eatingSpeed);
+                records[i] = RecordWriter();
+                saveCat(records[i], batch[i]);
+            }
+            lsn = saved_Cats.save(batch, count, [&](size_t i) { return wal.append(CatRecord, records[i].data()); });
+        }
+        return lsn;
+    }
 
-        // Verificare (Afiș)
-        cout << "Input Received: " << name << ", " << age << ", " << weight << ", " << eatingSpeed << ", " << feedingSchedule << endl;
+    // One import line into cat (its views into line or unescaped); what is wrong with it, or null
+    static const char* parseCatLine(string_view line, CatProfile& cat, deque<string>& unescaped) {
+        string_view age, weight;
+        bool badString = false;
+        cat.feedingSchedule = "08:00-19:00-";
+        bool flat = Ndjson::forEachField(line, [&](const Ndjson::Field& field) {
+            string_view* text = field.key == "name" ? &cat.name :
+                                field.key == "eatingSpeed" ? &cat.eatingSpeed :
+                                field.key == "feedingSchedule" ? &cat.feedingSchedule :
+                                field.key == "age" ? &age :
+                                field.key == "weight" ? &weight : nullptr;
+            if (text == nullptr)
+                return;
+            *text = field.value;
+            if (field.escaped) {
+                unescaped.emplace_back();
+                if (!Ndjson::unescape(field.value, unescaped.back()))
+                    badString = true;
+                *text = unescaped.back();
+            }
+        });
+        if (!flat || badString)
+            return "not a flat JSON object";
+        if (cat.name.empty())
+            return "the name is missing";
+        // the numbers are checked by their rules, so strtof stops at the quote or separator after them
+        if (!Validators::matches(Validators::age, age) || !Validators::matches(Validators::weight, weight))
+            return "age and weight are numbers like 3.5";
+        if (!Validators::matches(Validators::eatingSpeed, cat.eatingSpeed))
+            return "eatingSpeed is fast, medium or slow";
+        if (!Validators::matches(Validators::feedingSchedule, cat.feedingSchedule))
+            return "feedingSchedule is like 08:00-19:00-";
+        cat.age = strtof(age.data(), nullptr);
+        cat.weight = strtof(weight.data(), nullptr);
+        return nullptr;
+    }
+
+    // All the saved cats (of every core), one JSON object per line, in the format of POST /cats/import. The
+    // body is sent in chunks of ExportRows cats, rendered with the registry's read lock held only for the
+    // chunk, so the memory used does not grow with the fleet.
+    void exportCats(const Rest::Request&, Http::ResponseWriter response) {
+        using namespace Http;
+        response.headers()
+                    .add<Header::Server>("pistache/0.1")
+                    .add<Header::ContentType>(MIME(Application, Json));
+        requestMetrics.status(static_cast<int>(Http::Code::Ok));
+        auto stream = response.stream(Http::Code::Ok);
+
+        string chunk;
+        for (CatAwayEndpoint* owner : catOwners()) {
+            uint32_t row = 0;
+            while (true) {
+                chunk.clear();
+                uint32_t next = owner->saved_Cats.forEachFrom(row, ExportRows, [&](const CatProfile& cat) {
+                    appendCatLine(chunk, cat);
+                });
+                if (next == row)
+                    break;
+                row = next;
+                stream.write(chunk.data(), chunk.size());
+                stream.flush();
+            }
+        }
+        stream.ends();
+    }
 
-        response.send(Http::Code::Ok, "Cat Info Saved! Meow! \n");
+    static void appendCatLine(string& out, const CatProfile& cat) {
+        char numbers[64];
+        out += "{\"name\":";
+        Ndjson::appendString(out, cat.name);
+        snprintf(numbers, sizeof(numbers), ",\"age\":%.2f,\"weight\":%.2f,\"eatingSpeed\":", cat.age, cat.weight);
+        out += numbers;
+        Ndjson::appendString(out, cat.eatingSpeed);
+        out += ",\"feedingSchedule\":";
+        Ndjson::appendString(out, cat.feedingSchedule);
+        snprintf(numbers, sizeof(numbers), ",\"recFoodG\":%d,\"nrBreaks\":%d}\n", cat.recFoodG, cat.nrBreaks);
+        out += numbers;
     }
 
     // Luăm info despre pisi care folosesc dispenser-ul
     void getCatDetails(const Rest::Request& request, Http::ResponseWriter response)
     {
-        string returnString = "No Cat Found!";
         auto TextParam = request.param(":name").as<std::string>();
-        for(Cat* &catAux: saved_Cats)
-        {
-            if(catAux->name == TextParam)
-                returnString = "Name: " + TextParam + "\nAge: " + to_string(catAux->age).substr(0, 4) + "\nWeight: " + to_string(catAux->weight).substr(0, 4) +
-                               "\nEating Speed: " + catAux->eatingSpeed + "\nFeeding Schedule: " + catAux->feedingSchedule +
-                               "\nRecommended Quantity of Food (g): " + to_string(catAux->recFoodG) + "\nNr of Breaks: " + to_string(catAux->nrBreaks) + "\n";
-        }
+        shared_ptr<const string> details = catOwner(TextParam).saved_Cats.findDetails(TextParam);
+        if(details != nullptr)
+            reply(response, Http::Code::Ok, *details);
+        else
+            reply(response, Http::Code::Ok, "No Cat Found!");
+    }
+
+    // Averages over all the saved cats, from the columns of the registry (of every core)
+    void getFleetStats(const Rest::Request&, Http::ResponseWriter response) {
+        CatRegistry::FleetStats stats;
+        for (CatAwayEndpoint* owner : catOwners())
+            stats.add(owner->saved_Cats.fleetStats());
+        char averages[96];
+        snprintf(averages, sizeof(averages), "Mean age: %.2f\nMean weight: %.2f\n", stats.meanAge, stats.meanWeight);
 
-        response.send(Http::Code::Ok, returnString.c_str());
+        using namespace Http;
+        response.headers()
+                    .add<Header::Server>("pistache/0.1")
+                    .add<Header::ContentType>(MIME(Text, Plain));
+
+        reply(response, Http::Code::Ok, "Cats: " + to_string(stats.cats) + "\n" + averages +
+                                      "Eating speed: " + to_string(stats.bySpeed[1]) + " slow, " + to_string(stats.bySpeed[2]) +
+                                      " medium, " + to_string(stats.bySpeed[3]) + " fast\n" +
+                                      "Recommended food: " + to_string(stats.recFoodG) + " g a day\n" +
+                                      "Registry memory: " + to_string(stats.cats == 0 ? 0 : stats.bytes / stats.cats) + " bytes per cat\n");
     }
 
     // Create the lock which prevents concurrent editing of the same variable
     using Lock = std::mutex;
     using Guard = std::lock_guard<Lock>;
-    Lock CatAwayLock;
 
-    // Instance of the CatAway model
-    CatAway cat;
+    // Guard of the request handlers: the time spent waiting for the lock goes to /metrics
+    class MeasuredGuard {
+    public:
+        explicit MeasuredGuard(Lock& lock) : lock(lock) {
+            if (lock.try_lock()) {
+                requestMetrics.lockWait(0);
+                return;
+            }
+            auto start = std::chrono::steady_clock::now();
+            lock.lock();
+            requestMetrics.lockWait(std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count());
+        }
+
+        ~MeasuredGuard() {
+            lock.unlock();
+        }
+
+        MeasuredGuard(const MeasuredGuard&) = delete;
+        MeasuredGuard& operator=(const MeasuredGuard&) = delete;
+
+    private:
+        Lock& lock;
+    };
+
+    struct Device;
+    struct AlertTimer : TimerWheel::Timer {
+        Device* device = nullptr;
+    };
+
+    // One dispenser of the fleet, with its own lock, so requests for different devices never contend
+    struct Device {
+        Lock lock;
+        CatAway cat;
+        string id;
+        uint64_t lsn = 0;           // last record of this device in the write-ahead log
+        Seqlock<DispenserStatus> status;        // for the status feed, read without the lock
+        Seqlock<PublishedState> published;      // for the MQTT state topics, read without the lock
+        Rcu::Published<SettingsView> settings;  // for the GET routes, read without the lock
+        AlertTimer alertTimer;                  // in alertTimers, at cat.nextAlertCheck()
+    };
+
+    // Registry of all the dispensers served by this process.
+    // The ids are spread over independent shards, each guarded by its own reader-writer lock,
+    // so only lookups landing in the same shard can meet (and only when one of them creates a device).
+    class DeviceRegistry {
+    public:
+        // Returns the device with the given id, creating it on first use
+        Device& get(const string& id) {
+            Shard& shard = shardFor(id);
+            {
+                std::shared_lock<std::shared_mutex> readGuard(shard.lock);
+                auto it = shard.devices.find(id);
+                if (it != shard.devices.end())
+                    return *it->second;
+            }
+            std::unique_lock<std::shared_mutex> writeGuard(shard.lock);
+            unique_ptr<Device>& device = shard.devices[id];
+            if (!device) {
+                device = make_unique<Device>();
+                device->id = id;
+                device->alertTimer.device = device.get();
+                DispenserStatus status = device->cat.getStatus();
+                device->status.update([&](DispenserStatus& published) { published = status; });
+                PublishedState state = device->cat.getPublishedState();
+                device->published.update([&](PublishedState& published) { published = state; });
+                device->settings.publish(device->cat.getSettingsView());
+            }
+            return *device;
+        }
+
+        // Returns nullptr for unknown ids (devices are never removed, so the pointer stays valid)
+        Device* find(const string& id) {
+            Shard& shard = shardFor(id);
+            std::shared_lock<std::shared_mutex> readGuard(shard.lock);
+            auto it = shard.devices.find(id);
+            return it == shard.devices.end() ? nullptr : it->second.get();
+        }
+
+        // Calls visit(device) for every device, one shard at a time
+        template<typename Visit>
+        void forEach(Visit visit) {
+            for (Shard& shard : shards) {
+                std::shared_lock<std::shared_mutex> readGuard(shard.lock);
+                for (auto& it : shard.devices)
+                    visit(*it.second);
+            }
+        }
+
+    private:
+        static const size_t NrShards = 64;
+
+        struct Shard {
+            std::shared_mutex lock;
+            unordered_map<string, unique_ptr<Device>> devices;
+        };
+
+        Shard& shardFor(const string& id) {
+            return shards[std::hash<string>()(id) % NrShards];
+        }
+
+        array<Shard, NrShards> shards;
+    };
+
+    const string DefaultDevice = "default";
+
+    // All the CatAway dispensers, indexed by device id
+    DeviceRegistry devices;
+
+    // pentru toate pisicile care folosesc dispenser-ul; in a thread-per-core server, those owned by this core
+    CatRegistry saved_Cats;
+
+    // Persistence: every change goes to the write-ahead log, a checkpoint folds the log into a snapshot
+    static constexpr int CheckpointSeconds = 60;
+    static const uint64_t CheckpointLogBytes = 64 << 20;
+
+    // Appends the device's new state to the log; called under the device lock, so the log keeps the
+    // order of the changes of a device. Returns the lsn to wait for (0 without persistence).
+    uint64_t logDevice(Device& device) {
+        if (!wal.isOpen())
+            return 0;
+        RecordWriter record;
+        record.putString(device.id);
+        device.cat.save(record);
+        device.lsn = wal.append(DeviceRecord, record.data());
+        return device.lsn;
+    }
+
+    void applyRecord(const LogRecord& record) {
+        RecordReader in(record.payload);
+        if (record.type == DeviceRecord) {
+            string id;
+            if (!in.getString(id))
+                return;
+            Device& device = devices.get(id);
+            Guard guard(device.lock);
+            if (record.lsn <= device.lsn)
+                return;
+            if (device.cat.load(in)) {
+                device.lsn = record.lsn;
+                deviceChanged(device);
+            }
+        }
+        else if (record.type == CatRecord) {
+            Cat cat;
+            if (loadCat(in, cat))
+                saved_Cats.save(cat, record.lsn);
+        }
+    }
+
+    // Maps the snapshot, replays the logs written after it, and opens a new log
+    void recover() {
+        mkdir(dataDir.c_str(), 0755);
+        auto started = chrono::steady_clock::now();
+        uint64_t lastLsn = 0;
+        uint64_t firstGeneration = 0;
+        size_t records = 0;
+        auto apply = [&](const LogRecord& record) {
+            applyRecord(record);
+            lastLsn = max(lastLsn, record.lsn);
+            records++;
+        };
+
+        {
+            MappedFile snapshot(snapshotPath(dataDir));
+            SnapshotHeader header;
+            if (snapshot.size() >= sizeof(header)) {
+                memcpy(&header, snapshot.data(), sizeof(header));
+                if (memcmp(header.magic, SnapshotMagic, sizeof(SnapshotMagic)) == 0) {
+                    firstGeneration = header.walGeneration;
+                    forEachRecord(snapshot.data() + sizeof(header), snapshot.size() - sizeof(header), apply);
+                }
+            }
+        }
+
+        uint64_t lastGeneration = firstGeneration;
+        for (uint64_t generation : walGenerations(dataDir)) {
+            if (generation < firstGeneration)
+                continue;
+            MappedFile log(walPath(dataDir, generation));
+            if (log.data() != nullptr)
+                forEachRecord(log.data(), log.size(), apply);
+            lastGeneration = max(lastGeneration, generation);
+        }
+
+        double ms = chrono::duration<double, milli>(chrono::steady_clock::now() - started).count();
+        cout << "Recovered " << records << " records from " << dataDir << " in " << ms << " ms" << endl;
+
+        if (!wal.open(dataDir, lastGeneration + 1, lastLsn + 1)) {
+            perror("could not open the write-ahead log, running without persistence");
+            return;
+        }
+        checkpointer = thread(&CatAwayEndpoint::checkpointLoop, this);
+    }
+
+    // Writes every device and cat to a new snapshot, then drops the logs it covers.
+    // The log is switched first: what is appended meanwhile lands in the new log and in the snapshot,
+    // and the lsn check at recovery keeps the newest of the two.
+    void checkpoint() {
+        lock_guard<mutex> guard(checkpointLock);
+        uint64_t generation = wal.rotate();
+
+        string records;
+        uint64_t count = 0;
+        devices.forEach([&](Device& device) {
+            RecordWriter record;
+            uint64_t lsn;
+            {
+                Guard deviceGuard(device.lock);
+                record.putString(device.id);
+                device.cat.save(record);
+                lsn = device.lsn;
+            }
+            frameRecord(records, lsn, DeviceRecord, record.data());
+            count++;
+        });
+        saved_Cats.forEach([&](const Cat& cat, uint64_t lsn) {
+            RecordWriter record;
+            saveCat(record, cat);
+            frameRecord(records, lsn, CatRecord, record.data());
+            count++;
+        });
+
+        if (!writeSnapshot(dataDir, generation, records, count)) {
+            perror("snapshot");
+            return;
+        }
+        for (uint64_t old : walGenerations(dataDir))
+            if (old < generation)
+                unlink(walPath(dataDir, old).c_str());
+    }
+
+    void checkpointLoop() {
+        unique_lock<mutex> guard(checkpointWait);
+        while (!stopping) {
+            checkpointWake.wait_for(guard, chrono::seconds(1));
+            if (stopping)
+                break;
+            bool due = wal.size() >= CheckpointLogBytes
+                    || (wal.size() > 0 && chrono::steady_clock::now() - lastCheckpoint >= chrono::seconds(CheckpointSeconds));
+            if (!due)
+                continue;
+            guard.unlock();
+            checkpoint();
+            guard.lock();
+            lastCheckpoint = chrono::steady_clock::now();
+        }
+    }
+
+    void stopCheckpoints() {
+        {
+            lock_guard<mutex> guard(checkpointWait);
+            stopping = true;
+            checkpointWake.notify_one();
+        }
+        if (checkpointer.joinable())
+            checkpointer.join();
+    }
+
+    // Called under the lock of the device after every change of its state
+    void deviceChanged(Device& device) {
+        device.settings.publish(device.cat.getSettingsView());
+        publishStatus(device);
+        publishState(device);
+        time_t next = device.cat.nextAlertCheck();
+        lock_guard<mutex> guard(alertTimersLock);
+        if (next == (time_t)(-1))
+            alertTimers.cancel(device.alertTimer);
+        else
+            alertTimers.schedule(device.alertTimer, static_cast<uint64_t>(next));
+    }
+
+    // Once a second, the timer wheel is moved to the dispenser clock; the devices whose timer went off get
+    // their alerts updated (and logged and published) without waiting for a request
+    void alertTimerLoop() {
+        unique_lock<mutex> guard(alertTimerWait);
+        while (!alertTimersStopping) {
+            alertTimerWake.wait_for(guard, chrono::seconds(1));
+            if (alertTimersStopping)
+                break;
+
+            vector<Device*> due;
+            {
+                lock_guard<mutex> timersGuard(alertTimersLock);
+                alertTimers.advance(static_cast<uint64_t>(dispenserClock.time()), [&](TimerWheel::Timer& timer) {
+                    due.push_back(static_cast<AlertTimer&>(timer).device);
+                });
+            }
+            for (Device* device : due) {
+                Guard deviceGuard(device->lock);
+                uint64_t before = device->cat.getAlerts().word;
+                device->cat.checkAlerts();
+                if (device->cat.getAlerts().word != before)
+                    logDevice(*device);
+                deviceChanged(*device);
+            }
+        }
+    }
+
+    void stopAlertTimers() {
+        {
+            lock_guard<mutex> guard(alertTimerWait);
+            alertTimersStopping = true;
+            alertTimerWake.notify_one();
+        }
+        if (alertTimerThread.joinable())
+            alertTimerThread.join();
+    }
+
+    // Called under the lock of the device after a change: if its status is different, it is published and
+    // the feed thread is woken up to answer the watchers of the device
+    void publishStatus(Device& device) {
+        DispenserStatus status = device.cat.getStatus(), published;
+        device.status.read(published);
+        if (status.alerts == published.alerts && status.foodG == published.foodG && status.waterMl == published.waterMl)
+            return;
+        device.status.update([&](DispenserStatus& current) { current = status; });
+        statusChanges.push(&device);       // when full, the next sweep answers the watchers
+    }
+
+    static bool samePublishedState(const PublishedState& a, const PublishedState& b) {
+        return a.weight == b.weight && a.age == b.age && strcmp(a.eatingSpeed, b.eatingSpeed) == 0 &&
+               a.status.alerts == b.status.alerts && a.status.foodG == b.status.foodG && a.status.waterMl == b.status.waterMl;
+    }
+
+    // Called under the lock of the device after a change: if what its state topic shows is different, it is
+    // updated and the device is queued for the MQTT publisher
+    void publishState(Device& device) {
+        PublishedState state = device.cat.getPublishedState(), published;
+        device.published.read(published);
+        if (samePublishedState(state, published))
+            return;
+        device.published.update([&](PublishedState& current) { current = state; });
+        if (!stateChanges.push(&device))
+            stateChangesLost = true;        // the publisher goes through all the devices instead
+    }
+
+    // Fan-out of the status changes: one thread renders each new status once and sends it to all the
+    // watchers of the device, so they neither take the device lock nor poll.
+    // Once a second it also answers the watchers that timed out (or whose change did not fit in the queue).
+    void statusFeedLoop() {
+        auto lastSweep = chrono::steady_clock::now();
+        while (!statusFeedStopping.load()) {
+            Device* changed;
+            if (statusChanges.pop(changed, 1000)) {
+                vector<Device*> devices = {changed};
+                while (devices.size() < 1024 && statusChanges.tryPop(changed))
+                    devices.push_back(changed);
+                sort(devices.begin(), devices.end());
+                devices.erase(unique(devices.begin(), devices.end()), devices.end());
+                for (Device* device : devices)
+                    answerWatchers(*device, chrono::steady_clock::time_point::max());
+            }
+
+            auto now = chrono::steady_clock::now();
+            if (now - lastSweep < chrono::seconds(1))
+                continue;
+            lastSweep = now;
+            vector<Device*> watched;
+            {
+                lock_guard<mutex> guard(watchersLock);
+                for (auto& it : watchers)
+                    watched.push_back(it.first);
+            }
+            for (Device* device : watched)
+                answerWatchers(*device, now);
+        }
+    }
+
+    // Answers the watchers of the device that are behind its status, or whose poll is older than expired
+    void answerWatchers(Device& device, chrono::steady_clock::time_point expired) {
+        vector<Watcher> ready;
+        uint64_t version = device.status.version();
+        {
+            lock_guard<mutex> guard(watchersLock);
+            auto it = watchers.find(&device);
+            if (it == watchers.end())
+                return;
+            vector<Watcher> waiting;
+            for (Watcher& watcher : it->second) {
+                if (watcher.since < version || watcher.deadline <= expired)
+                    ready.push_back(std::move(watcher));
+                else
+                    waiting.push_back(std::move(watcher));
+            }
+            if (waiting.empty())
+                watchers.erase(it);
+            else
+                it->second.swap(waiting);
+        }
+        if (ready.empty())
+            return;
+
+        string body = renderStatus(device);
+        for (Watcher& watcher : ready) {
+            watcher.response.send(Http::Code::Ok, body);
+            requestMetrics.finish(watcher.measure, static_cast<int>(Http::Code::Ok));
+        }
+    }
+
+    static string renderStatus(const Device& device) {
+        DispenserStatus status;
+        uint64_t version = device.status.read(status);
+        return "version " + to_string(version) + '\n' + statusBodies()[AlertState::Snapshot{status.alerts}.colors()] +
+               "The current quantity of food is " + to_string(status.foodG) + " g\n" +
+               "The current quantity of water is " + to_string(status.waterMl) + " ml\n";
+    }
+
+    // Binary telemetry. A TCP connection is a stream of frames, answered with one Telemetry::Status byte
+    // per frame once the frames of a read are on disk; a UDP datagram holds whole frames and is not answered.
+    struct TelemetryConnection {
+        int fd;
+        size_t used = 0;
+        Device* device = nullptr;           // of the last frame: a dispenser sends only its own id
+        string answers;                     // of the frames read, sent once they are on disk
+        uint64_t lsn = 0;                   // the last of them to wait for
+        char buffer[64 * 1024];
+    };
+
+    void telemetryLoop() {
+        int poller = epoll_create1(0);
+        epoll_event event = {};
+        event.events = EPOLLIN | EPOLLEXCLUSIVE;    // a new connection or datagram wakes one thread only
+        event.data.fd = telemetryTcp;
+        epoll_ctl(poller, EPOLL_CTL_ADD, telemetryTcp, &event);
+        event.data.fd = telemetryUdp;
+        epoll_ctl(poller, EPOLL_CTL_ADD, telemetryUdp, &event);
+
+        unordered_map<int, unique_ptr<TelemetryConnection>> connections;
+        vector<TelemetryConnection*> answering;
+        Device* udpDevice = nullptr;
+        epoll_event ready[64];
+        while (!telemetryStopping.load()) {
+            int count = epoll_wait(poller, ready, 64, 200);
+            answering.clear();
+            for (int i = 0; i < count; i++) {
+                int fd = ready[i].data.fd;
+                if (fd == telemetryTcp) {
+                    int client = accept4(telemetryTcp, nullptr, nullptr, SOCK_NONBLOCK);
+                    if (client < 0)
+                        continue;
+                    auto connection = make_unique<TelemetryConnection>();
+                    connection->fd = client;
+                    epoll_event clientEvent = {};
+                    clientEvent.events = EPOLLIN;
+                    clientEvent.data.fd = client;
+                    epoll_ctl(poller, EPOLL_CTL_ADD, client, &clientEvent);
+                    connections[client] = std::move(connection);
+                } else if (fd == telemetryUdp) {
+                    readDatagrams(udpDevice);
+                } else {
+                    TelemetryConnection* connection = connections[fd].get();
+                    if (!readFrames(*connection)) {
+                        close(fd);
+                        connections.erase(fd);
+                    } else if (!connection->answers.empty()) {
+                        answering.push_back(connection);
+                    }
+                }
+            }
+
+            // The frames of all the ready connections are applied first: one wait for the log covers them
+            // all (group commit), instead of one sync per connection
+            uint64_t lsn = 0;
+            for (TelemetryConnection* connection : answering)
+                lsn = max(lsn, connection->lsn);
+            wal.waitDurable(lsn);
+            for (TelemetryConnection* connection : answering) {
+                if (!answerFrames(*connection)) {
+                    int fd = connection->fd;
+                    close(fd);
+                    connections.erase(fd);
+                }
+            }
+        }
+        for (auto& it : connections)
+            close(it.first);
+        close(poller);
+    }
+
+    // Applies the frames received on the connection, their answers wait in it; false when it is closed or broken
+    bool readFrames(TelemetryConnection& connection) {
+        ssize_t n = recv(connection.fd, connection.buffer + connection.used, sizeof(connection.buffer) - connection.used, 0);
+        if (n <= 0)
+            return n < 0 && errno == EAGAIN;
+        connection.used += n;
+
+        size_t at = 0;
+        for (;;) {
+            Telemetry::Frame frame;
+            Telemetry::Status status = Telemetry::parseFrame(string_view(connection.buffer + at, connection.used - at), frame);
+            if (status == Telemetry::Status::Incomplete)
+                break;
+            if (frame.size == 0)
+                return false;                       // no size to skip: the stream is lost
+            if (status == Telemetry::Status::Applied)
+                status = applyFrame(frame, connection.device, connection.lsn);
+            connection.answers += static_cast<char>(status);
+            at += frame.size;
+        }
+        memmove(connection.buffer, connection.buffer + at, connection.used - at);
+        connection.used -= at;
+        return true;
+    }
+
+    // Sends the answers of the frames read, after the log was synced up to them; false when the send failed
+    bool answerFrames(TelemetryConnection& connection) {
+        string& answers = connection.answers;
+        // the frames applied since the last answer are acknowledged only once on disk (no wait left here)
+        if (!wal.waitDurable(connection.lsn))
+            replace(answers.begin(), answers.end(), static_cast<char>(Telemetry::Status::Applied),
+                    static_cast<char>(Telemetry::Status::NotDurable));
+        bool sent = send(connection.fd, answers.data(), answers.size(), MSG_NOSIGNAL) == (ssize_t)answers.size();
+        answers.clear();
+        connection.lsn = 0;
+        return sent;
+    }
+
+    void readDatagrams(Device*& device) {
+        char datagram[Telemetry::MaxFrameSize * 8];
+        for (int i = 0; i < 64; i++) {
+            ssize_t n = recv(telemetryUdp, datagram, sizeof(datagram), MSG_DONTWAIT);
+            if (n <= 0)
+                return;
+            uint64_t lsn = 0;
+            for (size_t at = 0; at < (size_t)n;) {
+                Telemetry::Frame frame;
+                Telemetry::Status status = Telemetry::parseFrame(string_view(datagram + at, n - at), frame);
+                if (frame.size == 0)
+                    break;
+                if (status == Telemetry::Status::Applied)
+                    applyFrame(frame, device, lsn);
+                at += frame.size;
+            }
+        }
+    }
+
+    // Sets the tokens of a frame on its device, as addSetting does, all under one lock and one log record
+    Telemetry::Status applyFrame(const Telemetry::Frame& frame, Device*& device, uint64_t& lsn) {
+        if (device == nullptr || device->id != frame.deviceId)
+            device = &devices.get(string(frame.deviceId));
+        Guard guard(device->lock);
+        Telemetry::Status status = Telemetry::forEachToken(frame, [&](const Telemetry::Token& token) {
+            Setting setting = frameSettings[token.field];
+            if (Frames::fields[token.field].encoding == Frames::Encoding::Text)
+                device->cat.set(setting, string(token.text));
+            else
+                device->cat.setNumber(setting, token.number);
+        });
+        if (status == Telemetry::Status::Applied) {
+            lsn = max(lsn, logDevice(*device));
+            deviceChanged(*device);
+        }
+        return status;
+    }
+
+    // MQTT telemetry. The topics are <prefix><device id>/consumption, with the lines of /consumption/batch,
+    // and <prefix><device id>/settings/<setting>, with a value as in /settings/add (lastConsumedFood,
+    // emptyFoodTank, foodIsRefilled, ...).
+    struct MqttMessage {
+        string device;
+        string kind;                // "consumption", or the name of the setting
+        string payload;
+    };
+
+    // On the mosquitto thread: the message is only copied out (its memory is the library's)
+    void mqttReceived(const struct mosquitto_message* message) {
+        string_view topic = message->topic;
+        if (topic.compare(0, MqttTopicPrefix.size(), MqttTopicPrefix) != 0)
+            return;
+        topic.remove_prefix(MqttTopicPrefix.size());
+        size_t slash = topic.find('/');
+        if (slash == string_view::npos || slash == 0)
+            return;
+        string_view kind = topic.substr(slash + 1);
+        if (kind.compare(0, 9, "settings/") == 0)
+            kind.remove_prefix(9);
+        else if (kind != "consumption")
+            return;
+
+        MqttMessage received{string(topic.substr(0, slash)), string(kind),
+                             string(static_cast<const char*>(message->payload), message->payloadlen)};
+        lock_guard<mutex> guard(mqttLock);
+        mqttPending.push_back(std::move(received));
+        if (mqttPending.size() == 1)
+            mqttWake.notify_one();
+    }
+
+    // Takes everything received so far and applies it device by device: one lock, one log record and one
+    // status update per device for the whole batch, whatever the number of messages
+    void mqttApplyLoop() {
+        vector<MqttMessage> batch;
+        for (;;) {
+            {
+                unique_lock<mutex> guard(mqttLock);
+                mqttWake.wait(guard, [this] { return !mqttPending.empty() || mqttStopping; });
+                if (mqttPending.empty())
+                    return;
+                batch.swap(mqttPending);
+            }
+            // the messages of a device keep their order
+            stable_sort(batch.begin(), batch.end(), [](const MqttMessage& a, const MqttMessage& b) { return a.device < b.device; });
+            for (size_t first = 0, last; first < batch.size(); first = last) {
+                for (last = first + 1; last < batch.size() && batch[last].device == batch[first].device; last++)
+                    ;
+                applyMqttMessages(batch.data() + first, batch.data() + last);
+            }
+            batch.clear();
+        }
+    }
+
+    void applyMqttMessages(const MqttMessage* first, const MqttMessage* last) {
+        Device& device = devices.get(first->device);
+        vector<ConsumptionEvent> events;
+        auto consumeEvents = [&] {
+            stable_sort(events.begin(), events.end(), [](const ConsumptionEvent& a, const ConsumptionEvent& b) {
+                return a.time < b.time;
+            });
+            device.cat.consume(events);
+            events.clear();
+        };
+        Guard guard(device.lock);
+        for (const MqttMessage* message = first; message != last; message++) {
+            if (message->kind == "consumption") {
+                vector<ConsumptionEvent> received;
+                size_t badLine;
+                if (parseConsumptionEvents(message->payload, received, badLine))
+                    events.insert(events.end(), received.begin(), received.end());
+                else
+                    mqttRejected(*message, "line " + to_string(badLine) + " is not a \"<food|water> <unix time> <amount>\" event");
+                continue;
+            }
+            Setting setting = settingFromName(message->kind);
+            const Validators::Dfa* validator = settingValidator(setting);
+            if (validator == nullptr || !Validators::matches(*validator, message->payload)) {
+                mqttRejected(*message, "not a valid value");
+                continue;
+            }
+            // the consumption received before the setting goes first
+            if (!events.empty())
+                consumeEvents();
+            device.cat.set(setting, message->payload);
+        }
+        if (!events.empty())
+            consumeEvents();
+        logDevice(device);
+        deviceChanged(device);
+    }
+
+    // Publishes the state of the changed dispensers. A change is not sent at once: the devices changed within
+    // the next MqttCoalesceMs are gathered, and each is sent once with its latest state, however many times
+    // it changed. Per device that is the full state on <prefix><id>/state, retained so a subscriber gets it
+    // as soon as it subscribes, and what changed since the previous one on <prefix><id>/delta.
+    void mqttPublishLoop() {
+        unordered_map<Device*, SentState> sent;
+        while (!mqttPublisherStopping.load()) {
+            vector<Device*> changed;
+            Device* device;
+            if (stateChanges.pop(device, 1000)) {
+                this_thread::sleep_for(chrono::milliseconds(MqttCoalesceMs));
+                changed.push_back(device);
+                while (stateChanges.tryPop(device))
+                    changed.push_back(device);
+            }
+            if (stateChangesLost.exchange(false))
+                devices.forEach([&](Device& device) { changed.push_back(&device); });
+            sort(changed.begin(), changed.end());
+            changed.erase(unique(changed.begin(), changed.end()), changed.end());
+            for (Device* device : changed)
+                sendState(*device, sent);
+        }
+    }
+
+    struct SentState {
+        uint64_t version = 0;
+        PublishedState state;
+    };
+
+    void sendState(Device& device, unordered_map<Device*, SentState>& sent) {
+        SentState current;
+        current.version = device.published.read(current.state);
+        SentState& previous = sent[&device];
+        if (previous.version == current.version)
+            return;
+        string topic = string(MqttTopicPrefix) + device.id;
+        string delta = renderStateDelta(previous, current), state = renderState(current);
+        mosquitto_publish(mqttClient, nullptr, (topic + "/delta").c_str(), delta.size(), delta.data(), 1, false);
+        mosquitto_publish(mqttClient, nullptr, (topic + "/state").c_str(), state.size(), state.data(), 1, true);
+        previous = current;
+    }
+
+    // One line of compact JSON, e.g. {"v":14,"weight":4.20,"age":3.50,"eatingSpeed":"medium","foodG":880,
+    // "waterMl":1200,"tank":"Green","expiry":"Green","refresh":"Green"}.
+    // The only string setting, eatingSpeed, passed the eatingSpeed rule of buffers.json (^(fast|slow|medium)$,
+    // Validators::eatingSpeed) when set, or is still empty, so it needs no escaping; the rest are numbers
+    // and alert color names.
+    static string renderState(const SentState& sent) {
+        return renderStateFields(sent, nullptr);
+    }
+
+    // Only the fields different from the previous message of the device, with its version as "since"
+    // (0 for the first one, which then has all the fields): {"v":14,"since":12,"foodG":880}
+    static string renderStateDelta(const SentState& previous, const SentState& sent) {
+        return renderStateFields(sent, &previous);
+    }
+
+    static string renderStateFields(const SentState& sent, const SentState* previous) {
+        const PublishedState& state = sent.state;
+        const PublishedState* before = previous == nullptr || previous->version == 0 ? nullptr : &previous->state;
+        char number[32];
+        string json = "{\"v\":" + to_string(sent.version);
+        if (previous != nullptr)
+            json += ",\"since\":" + to_string(previous->version);
+        if (before == nullptr || state.weight != before->weight) {
+            snprintf(number, sizeof(number), "%.2f", state.weight);
+            json += ",\"weight\":" + string(number);
+        }
+        if (before == nullptr || state.age != before->age) {
+            snprintf(number, sizeof(number), "%.2f", state.age);
+            json += ",\"age\":" + string(number);
+        }
+        if (before == nullptr || strcmp(state.eatingSpeed, before->eatingSpeed) != 0)
+            json += ",\"eatingSpeed\":\"" + string(state.eatingSpeed) + '"';
+        if (before == nullptr || state.status.foodG != before->status.foodG)
+            json += ",\"foodG\":" + to_string(state.status.foodG);
+        if (before == nullptr || state.status.waterMl != before->status.waterMl)
+            json += ",\"waterMl\":" + to_string(state.status.waterMl);
+        static const pair<AlertKind, const char*> alertFields[] = {
+            {AlertKind::EmptyTank, "tank"}, {AlertKind::ExpiredFood, "expiry"}, {AlertKind::NeedsRefreshment, "refresh"}};
+        AlertState::Snapshot alerts = {state.status.alerts};
+        for (auto& field : alertFields) {
+            AlertColor color = alerts.color(field.first);
+            if (before == nullptr || color != AlertState::Snapshot{before->status.alerts}.color(field.first))
+                json += ",\"" + string(field.second) + "\":\"" + alertColorName(color) + '"';
+        }
+        return json + '}';
+    }
+
+    void mqttRejected(const MqttMessage& message, const string& why) {
+        cerr << "MQTT telemetry of " << message.device << '/' << message.kind << " was dropped: " << why << endl;
+    }
+
+    void stopMqtt() {
+        if (mqttClient == nullptr)
+            return;
+        mqttPublisherStopping = true;
+        mqttPublisher.join();
+        mosquitto_disconnect(mqttClient);
+        mosquitto_loop_stop(mqttClient, false);
+        mosquitto_destroy(mqttClient);
+        mqttClient = nullptr;
+        {
+            lock_guard<mutex> guard(mqttLock);
+            mqttStopping = true;
+            mqttWake.notify_one();
+        }
+        mqttApplier.join();
+    }
+
+    void stopTelemetry() {
+        telemetryStopping = true;
+        for (thread& worker : telemetryThreads)
+            worker.join();
+        telemetryThreads.clear();
+        for (int* fd : {&telemetryTcp, &telemetryUdp}) {
+            if (*fd >= 0)
+                close(*fd);
+            *fd = -1;
+        }
+    }
+
+    void stopStatusFeed() {
+        statusFeedStopping = true;
+        if (statusFeed.joinable())
+            statusFeed.join();
+    }
+
+    static constexpr int StatusPollSeconds = 30;
+
+    struct Watcher {
+        uint64_t since;
+        chrono::steady_clock::time_point deadline;
+        Http::ResponseWriter response;
+        RequestMetrics::Deferred measure;
+    };
+
+    mutex alertTimersLock;
+    TimerWheel alertTimers{static_cast<uint64_t>(dispenserClock.time())};
+    thread alertTimerThread;
+    mutex alertTimerWait;
+    condition_variable alertTimerWake;
+    bool alertTimersStopping = false;
+
+    BoundedQueue<Device*, 4096> statusChanges;
+    mutex watchersLock;
+    unordered_map<Device*, vector<Watcher>> watchers;
+    thread statusFeed;
+    atomic<bool> statusFeedStopping{false};
+
+    int telemetryTcp = -1;
+    int telemetryUdp = -1;
+    vector<thread> telemetryThreads;
+    atomic<bool> telemetryStopping{false};
+
+    vector<CatAwayEndpoint*> partitions;            // all the cores of a thread-per-core server, empty otherwise
+    size_t partition = 0;
+    vector<Rest::Route::Handler> routeHandlers;     // the per-device routes, by the index forwarded
+    static const int ForwardThreads = 4;
+    vector<thread> forwarders;
+    mutex forwardLock;
+    condition_variable forwardWake;
+    deque<Forwarded> forwardPending;
+    bool forwardStopping = false;
+
+    static constexpr string_view MqttTopicPrefix = "cataway/";
+    static constexpr int MqttCoalesceMs = 100;
+    struct mosquitto* mqttClient = nullptr;
+    thread mqttApplier;
+    mutex mqttLock;
+    condition_variable mqttWake;
+    vector<MqttMessage> mqttPending;
+    bool mqttStopping = false;
+
+    BoundedQueue<Device*, 4096> stateChanges;
+    atomic<bool> stateChangesLost{false};
+    thread mqttPublisher;
+    atomic<bool> mqttPublisherStopping{false};
+
+    string dataDir;
+    WriteAheadLog wal;
+    thread checkpointer;
+    mutex checkpointLock;
+    mutex checkpointWait;
+    condition_variable checkpointWake;
+    bool stopping = false;
+    chrono::steady_clock::time_point lastCheckpoint = chrono::steady_clock::now();
 
     // Defining the httpEndpoint and a router.
     std::shared_ptr<Http::Endpoint> httpEndpoint;
@@ -827,6 +3137,82 @@ private:
 };
 
 
+// Thread-per-core serving: one CatAwayEndpoint per core, pinned to its CPU together with all its threads,
+// every one listening on the same port (SO_REUSEPORT: the kernel spreads the connections over the cores).
+// Every dispenser belongs to one core (CatAwayEndpoint::partitionOf), which alone has it in its registry
+// and its write-ahead log; a request landing on another core is handed over to the owner's forwarders, so
+// the cores share no device state and contend on no device lock. The cats are split the same way, by
+// name: a cat route is served where it lands, on the registry and the log of the core owning the cat, so
+// every profile is kept and snapshotted once. What the cores do share is the request metrics (a shard per
+// thread, locked only to add a route or a thread and to scrape) and the cached clock (only read).
+class CatAwayCores {
+public:
+    // Takes the first `cores` CPUs this process may run on. With a data directory, core i logs to
+    // <dataDir>/core<i>: the same number of cores is needed to recover it.
+    CatAwayCores(Address addr, size_t cores, const string& dataDir = "") : cpus(allowedCpus(cores)) {
+        if (!dataDir.empty())
+            mkdir(dataDir.c_str(), 0755);
+
+        for (size_t core = 0; core < cpus.size(); core++)
+            onCore(core, [&] {
+                string coreDir = dataDir.empty() ? "" : dataDir + "/core" + to_string(core);
+                endpoints.push_back(make_unique<CatAwayEndpoint>(addr, coreDir));
+            });
+        vector<CatAwayEndpoint*> partitions;
+        for (auto& endpoint : endpoints)
+            partitions.push_back(endpoint.get());
+        for (size_t core = 0; core < endpoints.size(); core++)
+            endpoints[core]->partitionWith(partitions, core);
+    }
+
+    size_t size() const {
+        return endpoints.size();
+    }
+
+    // Every core is served by one Pistache thread, plus its forwarders (all pinned to it)
+    void start() {
+        for (size_t core = 0; core < endpoints.size(); core++)
+            onCore(core, [&] {
+                endpoints[core]->init(1, true);
+                endpoints[core]->start();
+            });
+    }
+
+    void stop() {
+        for (auto& endpoint : endpoints)
+            endpoint->stop();
+    }
+
+    // The first `count` CPUs this thread may run on (fewer if there are not as many)
+    static vector<int> allowedCpus(size_t count) {
+        vector<int> cpus;
+        cpu_set_t allowed;
+        pthread_getaffinity_np(pthread_self(), sizeof(allowed), &allowed);
+        for (int cpu = 0; cpu < CPU_SETSIZE && cpus.size() < count; cpu++)
+            if (CPU_ISSET(cpu, &allowed))
+                cpus.push_back(cpu);
+        return cpus;
+    }
+
+private:
+    friend class CatAwayBench;
+
+    // Runs work on this thread pinned to the CPU of the core, so the threads it starts are pinned there too
+    template<typename Work>
+    void onCore(size_t core, Work work) {
+        cpu_set_t original, pinned;
+        pthread_getaffinity_np(pthread_self(), sizeof(original), &original);
+        CPU_ZERO(&pinned);
+        CPU_SET(cpus[core], &pinned);
+        pthread_setaffinity_np(pthread_self(), sizeof(pinned), &pinned);
+        work();
+        pthread_setaffinity_np(pthread_self(), sizeof(original), &original);
+    }
+
+    vector<int> cpus;
+    vector<unique_ptr<CatAwayEndpoint>> endpoints;
+};
+
 void pistacheThread(int argc, char** argv) {
     // This code is needed for gracefull shutdown of the server when no longer needed.
     sigset_t signals;
@@ -842,27 +3228,55 @@ void pistacheThread(int argc, char** argv) {
     // Set a port on which your server to communicate
     Port port(8080);
 
-    // Number of threads used by the server
+    // Number of threads used by the server; "per-core" for one pinned endpoint per core (CatAwayCores)
     int thr = 2;
+    bool perCore = false;
 
     if (argc >= 2) {
         port = static_cast<uint16_t>(std::stol(argv[1]));
 
-        if (argc == 3)
-            thr = std::stoi(argv[2]);
+        if (argc >= 3) {
+            perCore = string(argv[2]) == "per-core";
+            thr = perCore ? static_cast<int>(hardware_concurrency()) : std::stoi(argv[2]);
+        }
     }
 
+    // Directory of the write-ahead log and the snapshots
+    string dataDir = "cataway-data";
+    if (argc >= 4)
+        dataDir = argv[3];
+
+    // Port of the binary telemetry (TCP and UDP)
+    uint16_t telemetryPort = 8081;
+    if (argc >= 5)
+        telemetryPort = static_cast<uint16_t>(std::stol(argv[4]));
+
     Address addr(Ipv4::any(), port);
 
     cout << "Cores = " << hardware_concurrency() << endl;
+    if (perCore) {
+        CatAwayCores cores(addr, thr, dataDir);
+        cout << "Serving on " << cores.size() << " cores, one endpoint per core" << endl;
+        cout << "Binary telemetry and MQTT are not served in this mode" << endl;
+        cores.start();
+
+        int signal = 0;
+        if (sigwait(&signals, &signal) == 0)
+            std::cout << "received signal " << signal << std::endl;
+        cores.stop();
+        return;
+    }
+
     cout << "Using " << thr << " threads" << endl;
 
     // Instance of the class that defines what the server can do.
-    CatAwayEndpoint stats(addr);
+    CatAwayEndpoint stats(addr, dataDir);
 
     // Initialize and start the server
     stats.init(thr);
     stats.start();
+    stats.startTelemetry(telemetryPort, thr);
+    stats.startMqtt();
 
 
     // Code that waits for the shutdown sinal for the server
@@ -881,96 +3295,11 @@ void pistacheThread(int argc, char** argv) {
 
 }
 
-void printWeight(struct mosquitto *mosq) {
-	int rc;
-    
-    sleep(1);
-    string msg = "The weight of the cat is " + to_string(globalWeight).substr(0, 4);
-    int n = msg.length();
-    char msg_array[50];
-    strcpy(msg_array, msg.c_str());
-
-	rc = mosquitto_publish(mosq, NULL, "settings", n+1, msg_array, 0, false);
-	if(rc != MOSQ_ERR_SUCCESS){
-		fprintf(stderr, "Error publishing: %s\n", mosquitto_strerror(rc));
-	}
-}
-
-void printAge(struct mosquitto *mosq) {
-	int rc;
-    sleep(1);
-    string msg = "The age of the cat is " + to_string(globalAge).substr(0, 4);
-    int n = msg.length();
-    char msg_array[50];
-    strcpy(msg_array, msg.c_str());
-
-	rc = mosquitto_publish(mosq, NULL, "settings", n+1, msg_array, 0, false);
-	if(rc != MOSQ_ERR_SUCCESS){
-		fprintf(stderr, "Error publishing: %s\n", mosquitto_strerror(rc));
-	}
-}
-
-void printEatingSpeed(struct mosquitto *mosq) {
-	int rc; 
-    sleep(1);
-    string msg = "The cat has a " + globalEatingSpeed + " eating speed \n";
-    int n = msg.length();
-    char msg_array[50];
-    strcpy(msg_array, msg.c_str());
-
-	rc = mosquitto_publish(mosq, NULL, "settings", n+1, msg_array, 0, false);
-	if(rc != MOSQ_ERR_SUCCESS){
-		fprintf(stderr, "Error publishing: %s\n", mosquitto_strerror(rc));
-	}
-}
-
-void mosquittoThread(int arg, char** argv) {
-    int rc;
-   struct mosquitto *mosq;
-
-   mosquitto_lib_init();
-
-   mosq = mosquitto_new("publisher-test", true, NULL);
-
-   rc = mosquitto_connect(mosq, "localhost", 1883, 60);
-
-   if (rc != 0) {
-       printf("Client could not connect!");
-       mosquitto_destroy(mosq);
-       return;
-   }
-
-   rc = mosquitto_loop_start(mosq);
-
-   float currentWeight, currentAge;
-   string currentEatingSpeed;
-
-   while(1) {
-       if(currentWeight != globalWeight) {
-           printWeight(mosq);
-           currentWeight = globalWeight;
-       }
-
-       if(currentAge != globalAge) {
-           printAge(mosq);
-           currentAge = globalAge;
-       }
-
-       if(currentEatingSpeed != globalEatingSpeed) {
-           printEatingSpeed(mosq);
-           currentEatingSpeed = globalEatingSpeed;
-       }
-   }
-   
-   mosquitto_lib_cleanup();
-}
-
-
+#ifndef CATAWAY_NO_MAIN         // bench.cpp brings its own main
 int main(int argc, char *argv[]) {
     thread pistacheThr(pistacheThread, argc, argv);
-    thread mosquittoThr(mosquittoThread, argc, argv);
 
     pistacheThr.join();
-    mosquittoThr.join();
     return 0;
 }
+#endif
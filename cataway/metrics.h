@@ -0,0 +1,274 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <exception>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+// Histogram of durations in nanoseconds, with log-linear buckets as in HdrHistogram: every power of 2 is
+// split in 4, so a bucket is at most 25% wide. Only the thread owning it writes it (plain relaxed
+// stores, no locked instructions); any thread may read it while it is written.
+class LatencyHistogram {
+public:
+    static const int SubBits = 2;
+    static const int Exact = 2 << SubBits;      // 0..7 ns have a bucket each
+    static const int MaxExponent = 40;          // ~18 minutes; longer durations go to the last bucket
+    static const int NrBuckets = Exact + (MaxExponent - SubBits - 1) * (1 << SubBits);
+
+    void record(uint64_t ns) {
+        bump(buckets[bucketOf(ns)], 1);
+        bump(count, 1);
+        bump(sum, ns);
+    }
+
+    static int bucketOf(uint64_t ns) {
+        if (ns < static_cast<uint64_t>(Exact))
+            return static_cast<int>(ns);
+        int exponent = 63 - __builtin_clzll(ns);
+        if (exponent >= MaxExponent)
+            return NrBuckets - 1;
+        int sub = static_cast<int>(ns >> (exponent - SubBits)) & ((1 << SubBits) - 1);
+        return Exact + (exponent - SubBits - 1) * (1 << SubBits) + sub;
+    }
+
+    // The largest duration counted in a bucket
+    static uint64_t upperBound(int bucket) {
+        if (bucket < Exact)
+            return bucket;
+        int exponent = (bucket - Exact) / (1 << SubBits) + SubBits + 1;
+        int sub = (bucket - Exact) % (1 << SubBits);
+        uint64_t width = uint64_t(1) << (exponent - SubBits);
+        return ((1 << SubBits) + sub) * width + width - 1;
+    }
+
+    std::atomic<uint64_t> buckets[NrBuckets] = {};
+    std::atomic<uint64_t> count{0};
+    std::atomic<uint64_t> sum{0};
+
+private:
+    static void bump(std::atomic<uint64_t>& counter, uint64_t by) {
+        counter.store(counter.load(std::memory_order_relaxed) + by, std::memory_order_relaxed);
+    }
+};
+
+// Request metrics of the REST endpoint, per route: handler time, time spent waiting for device locks and
+// the number of answers by status code.
+// Every worker thread writes its own shard, so recording takes no lock and shares no cache line;
+// prometheus() adds the shards up when /metrics is scraped.
+class RequestMetrics {
+public:
+    static const int MaxRoutes = 64;
+    static const int NrCodes = 7;               // 200, 400, 404, 413, 500, 503, any other
+
+private:
+    struct Route {
+        LatencyHistogram latency;
+        LatencyHistogram lockWait;
+        std::atomic<uint64_t> codes[NrCodes] = {};
+    };
+
+    struct Shard {
+        Route routes[MaxRoutes];
+        int route = -1;                         // of the request being served, -1 between requests
+        int code = 0;
+        std::chrono::steady_clock::time_point start;
+    };
+
+public:
+    // Routes are added while the router is set up. A name added again (by another endpoint of a
+    // thread-per-core server) is the same route; the cores set up one after the other, so an endpoint
+    // already serving /metrics may be reading the names meanwhile, under the same lock.
+    int addRoute(const std::string& name) {
+        std::lock_guard<std::mutex> guard(shardsLock);
+        for (size_t route = 0; route < names.size(); route++)
+            if (names[route] == name)
+                return static_cast<int>(route);
+        if (names.size() == MaxRoutes)
+            return -1;
+        names.push_back(name);
+        return static_cast<int>(names.size() - 1);
+    }
+
+    // Measures one request on the thread serving it, from construction to destruction
+    class Measure {
+    public:
+        Measure(RequestMetrics& metrics, int route)
+            : shard(metrics.local()), exceptions(std::uncaught_exceptions()) {
+            shard.route = route;
+            shard.code = 0;
+            shard.start = std::chrono::steady_clock::now();
+        }
+
+        ~Measure() {
+            if (shard.route < 0)
+                return;
+            // a handler that threw is answered by Pistache with 500
+            record(shard, shard.route, shard.start, std::uncaught_exceptions() > exceptions ? 500 : shard.code);
+            shard.route = -1;
+        }
+
+        Measure(const Measure&) = delete;
+        Measure& operator=(const Measure&) = delete;
+
+    private:
+        Shard& shard;
+        int exceptions;
+    };
+
+    // The status code the current request is answered with
+    void status(int code) {
+        local().code = code;
+    }
+
+    // A request the handler leaves to be answered later by another thread (a parked long poll): its Measure
+    // records nothing, finish() records it, from the start of the handler, on the thread answering it
+    struct Deferred {
+        int route = -1;
+        std::chrono::steady_clock::time_point start;
+    };
+
+    Deferred defer() {
+        Shard& shard = local();
+        Deferred request{shard.route, shard.start};
+        shard.route = -1;
+        return request;
+    }
+
+    void finish(const Deferred& request, int code) {
+        if (request.route >= 0)
+            record(local(), request.route, request.start, code);
+    }
+
+    // Time the current request waited for a lock
+    void lockWait(uint64_t ns) {
+        Shard& shard = local();
+        if (shard.route >= 0)
+            shard.routes[shard.route].lockWait.record(ns);
+    }
+
+    // Prometheus text format. Routes that were never requested are left out.
+    std::string prometheus() const {
+        std::lock_guard<std::mutex> guard(shardsLock);
+        std::string out;
+        std::vector<size_t> requested;
+        for (size_t route = 0; route < names.size(); route++) {
+            uint64_t count = 0;
+            for (const auto& shard : shards)
+                count += shard->routes[route].latency.count.load(std::memory_order_relaxed);
+            if (count > 0)
+                requested.push_back(route);
+        }
+
+        out += "# HELP cataway_request_duration_seconds Time from the start of the route handler to the answer.\n"
+               "# TYPE cataway_request_duration_seconds histogram\n";
+        for (size_t route : requested)
+            appendHistogram(out, "cataway_request_duration_seconds", names[route], route, &Route::latency);
+
+        out += "# HELP cataway_lock_wait_seconds Time a request waited for the lock of its device.\n"
+               "# TYPE cataway_lock_wait_seconds histogram\n";
+        for (size_t route : requested)
+            appendHistogram(out, "cataway_lock_wait_seconds", names[route], route, &Route::lockWait);
+
+        out += "# HELP cataway_requests_total Requests answered, by route and status code.\n"
+               "# TYPE cataway_requests_total counter\n";
+        for (size_t route : requested) {
+            for (int code = 0; code < NrCodes; code++) {
+                uint64_t count = 0;
+                for (const auto& shard : shards)
+                    count += shard->routes[route].codes[code].load(std::memory_order_relaxed);
+                if (count == 0)
+                    continue;
+                out += "cataway_requests_total{route=\"" + names[route] + "\",code=\"" + codeLabel(code) + "\"} " +
+                       std::to_string(count) + '\n';
+            }
+        }
+        return out;
+    }
+
+private:
+    static void record(Shard& shard, int route, std::chrono::steady_clock::time_point start, int code) {
+        auto elapsed = std::chrono::steady_clock::now() - start;
+        Route& measured = shard.routes[route];
+        measured.latency.record(std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count());
+        std::atomic<uint64_t>& counter = measured.codes[codeIndex(code)];
+        counter.store(counter.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+    }
+
+    // The shard of the calling thread, made on its first request
+    Shard& local() {
+        thread_local const RequestMetrics* owner = nullptr;
+        thread_local Shard* shard = nullptr;
+        if (owner != this) {
+            std::lock_guard<std::mutex> guard(shardsLock);
+            shards.push_back(std::make_unique<Shard>());
+            shard = shards.back().get();
+            owner = this;
+        }
+        return *shard;
+    }
+
+    static int codeIndex(int code) {
+        switch (code) {
+        case 200: return 0;
+        case 400: return 1;
+        case 404: return 2;
+        case 413: return 3;
+        case 500: return 4;
+        case 503: return 5;
+        default: return 6;
+        }
+    }
+
+    static const char* codeLabel(int index) {
+        static const char* labels[NrCodes] = {"200", "400", "404", "413", "500", "503", "other"};
+        return labels[index];
+    }
+
+    // The fine buckets are folded into the usual Prometheus bounds: each one is counted under the first
+    // bound not below its largest duration.
+    void appendHistogram(std::string& out, const char* metric, const std::string& name, size_t route,
+                         LatencyHistogram Route::*histogram) const {
+        static const double Bounds[] = {1e-6, 2.5e-6, 5e-6, 1e-5, 2.5e-5, 5e-5, 1e-4, 2.5e-4, 5e-4, 1e-3, 2.5e-3,
+                                        5e-3, 0.01, 0.025, 0.05, 0.1, 0.25, 0.5, 1, 2.5, 5, 10};
+        const int NrBounds = sizeof(Bounds) / sizeof(Bounds[0]);
+
+        uint64_t perBound[NrBounds + 1] = {};
+        uint64_t count = 0, sum = 0;
+        for (const auto& shard : shards) {
+            const LatencyHistogram& h = shard->routes[route].*histogram;
+            int bound = 0;
+            for (int bucket = 0; bucket < LatencyHistogram::NrBuckets; bucket++) {
+                while (bound < NrBounds && LatencyHistogram::upperBound(bucket) > Bounds[bound] * 1e9)
+                    bound++;
+                perBound[bound] += h.buckets[bucket].load(std::memory_order_relaxed);
+            }
+            count += h.count.load(std::memory_order_relaxed);
+            sum += h.sum.load(std::memory_order_relaxed);
+        }
+
+        char line[256];
+        uint64_t cumulative = 0;
+        for (int bound = 0; bound < NrBounds; bound++) {
+            cumulative += perBound[bound];
+            snprintf(line, sizeof(line), "%s_bucket{route=\"%s\",le=\"%g\"} %llu\n", metric, name.c_str(),
+                     Bounds[bound], static_cast<unsigned long long>(cumulative));
+            out += line;
+        }
+        // the buckets and the count are read one after the other: +Inf is the count, so it is never below them
+        count = std::max(count, cumulative + perBound[NrBounds]);
+        snprintf(line, sizeof(line), "%s_bucket{route=\"%s\",le=\"+Inf\"} %llu\n%s_sum{route=\"%s\"} %.9f\n"
+                 "%s_count{route=\"%s\"} %llu\n", metric, name.c_str(), static_cast<unsigned long long>(count),
+                 metric, name.c_str(), sum / 1e9, metric, name.c_str(), static_cast<unsigned long long>(count));
+        out += line;
+    }
+
+    std::vector<std::string> names;
+    mutable std::mutex shardsLock;                  // for names and shards
+    std::vector<std::unique_ptr<Shard>> shards;
+};
@@ -0,0 +1,175 @@
+#pragma once
+
+#include <cstdio>
+#include <string>
+#include <string_view>
+
+// Newline-delimited JSON of flat objects, read in place: {"name":"Tom","age":3.5,"eatingSpeed":"slow"}
+// on every line. Keys and values are views into the line; a string value is given as written, between
+// its quotes, and only decoded (unescape) when it has escapes. Nested objects and arrays are not accepted.
+namespace Ndjson {
+
+struct Field {
+    std::string_view key;
+    std::string_view value;
+    bool isString;
+    bool escaped;               // the string value has escapes: see unescape
+};
+
+// Calls visit(line, lineNumber) for every line that is not blank; stops at the first visit returning false
+template<typename Visit>
+bool forEachLine(std::string_view text, Visit visit) {
+    size_t lineNumber = 0;
+    while (!text.empty()) {
+        size_t end = text.find('\n');
+        std::string_view line = text.substr(0, end);
+        text.remove_prefix(end == std::string_view::npos ? text.size() : end + 1);
+        lineNumber++;
+        if (line.find_first_not_of(" \t\r") == std::string_view::npos)
+            continue;
+        if (!visit(line, lineNumber))
+            return false;
+    }
+    return true;
+}
+
+inline void skipSpaces(std::string_view& text) {
+    while (!text.empty() && (text[0] == ' ' || text[0] == '\t' || text[0] == '\r'))
+        text.remove_prefix(1);
+}
+
+// The string at the start of text (after its opening quote): its contents and whether it has escapes
+inline bool readString(std::string_view& text, std::string_view& value, bool& escaped) {
+    escaped = false;
+    for (size_t i = 0; i < text.size(); i++) {
+        if (text[i] == '\\') {
+            escaped = true;
+            i++;
+        } else if (text[i] == '"') {
+            value = text.substr(0, i);
+            text.remove_prefix(i + 1);
+            return true;
+        } else if (static_cast<unsigned char>(text[i]) < 0x20) {
+            return false;
+        }
+    }
+    return false;
+}
+
+// Calls visit(Field) for every member of the object on the line; false when it is not a flat object
+template<typename Visit>
+bool forEachField(std::string_view line, Visit visit) {
+    skipSpaces(line);
+    if (line.empty() || line[0] != '{')
+        return false;
+    line.remove_prefix(1);
+    skipSpaces(line);
+    if (!line.empty() && line[0] == '}') {
+        line.remove_prefix(1);
+        skipSpaces(line);
+        return line.empty();
+    }
+    while (true) {
+        Field field;
+        bool keyEscaped;
+        skipSpaces(line);
+        if (line.empty() || line[0] != '"')
+            return false;
+        line.remove_prefix(1);
+        if (!readString(line, field.key, keyEscaped) || keyEscaped)
+            return false;
+        skipSpaces(line);
+        if (line.empty() || line[0] != ':')
+            return false;
+        line.remove_prefix(1);
+        skipSpaces(line);
+        if (line.empty())
+            return false;
+        if (line[0] == '"') {
+            line.remove_prefix(1);
+            field.isString = true;
+            if (!readString(line, field.value, field.escaped))
+                return false;
+        } else {
+            // a number, true, false or null, as written
+            size_t end = line.find_first_of(",} \t\r");
+            if (end == 0 || end == std::string_view::npos)
+                return false;
+            field.value = line.substr(0, end);
+            field.isString = false;
+            field.escaped = false;
+            line.remove_prefix(end);
+        }
+        visit(field);
+        skipSpaces(line);
+        if (line.empty())
+            return false;
+        if (line[0] == '}') {
+            line.remove_prefix(1);
+            skipSpaces(line);
+            return line.empty();
+        }
+        if (line[0] != ',')
+            return false;
+        line.remove_prefix(1);
+    }
+}
+
+// Decodes the escapes of a string value (\uXXXX only below 0x80); false for an invalid escape
+inline bool unescape(std::string_view value, std::string& text) {
+    text.clear();
+    for (size_t i = 0; i < value.size(); i++) {
+        if (value[i] != '\\') {
+            text += value[i];
+            continue;
+        }
+        if (++i == value.size())
+            return false;
+        switch (value[i]) {
+        case '"':  text += '"'; break;
+        case '\\': text += '\\'; break;
+        case '/':  text += '/'; break;
+        case 'b':  text += '\b'; break;
+        case 'f':  text += '\f'; break;
+        case 'n':  text += '\n'; break;
+        case 'r':  text += '\r'; break;
+        case 't':  text += '\t'; break;
+        case 'u': {
+            unsigned code = 0;
+            if (value.size() - i < 5 || sscanf(std::string(value.substr(i + 1, 4)).c_str(), "%4x", &code) != 1 || code >= 0x80)
+                return false;
+            text += static_cast<char>(code);
+            i += 4;
+            break;
+        }
+        default:
+            return false;
+        }
+    }
+    return true;
+}
+
+// Appends text as a JSON string, with its quotes
+inline void appendString(std::string& out, std::string_view text) {
+    out += '"';
+    for (char c : text) {
+        switch (c) {
+        case '"':  out += "\\\""; break;
+        case '\\': out += "\\\\"; break;
+        case '\n': out += "\\n"; break;
+        case '\r': out += "\\r"; break;
+        case '\t': out += "\\t"; break;
+        default:
+            if (static_cast<unsigned char>(c) < 0x20) {
+                char code[8];
+                snprintf(code, sizeof(code), "\\u%04x", c);
+                out += code;
+            } else {
+                out += c;
+            }
+        }
+    }
+    out += '"';
+}
+
+}
@@ -0,0 +1,186 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+// Read-copy-update. A value is reached through one atomic pointer and never changed in place: a writer
+// publishes a new copy and retires the old one, which is deleted once no reader can still be using it.
+// Readers take no lock and touch no shared counter, only a slot of their own thread, so reads of the same
+// value scale with the cores and never wait for a writer.
+//
+// A reader announces the epoch in which its read section started; a copy retired in epoch e is deleted
+// when every thread in a read section announced a later epoch (readers that started before the copy was
+// unpublished have announced e or earlier). Every writer thread keeps the copies it retired and deletes
+// them RetireBatch at a time, so writers do not meet either.
+namespace Rcu {
+
+const int MaxReaders = 1024;
+const size_t RetireBatch = 64;
+
+struct alignas(64) ReaderSlot {
+    std::atomic<uint64_t> epoch{0};         // 0 outside of read sections
+    std::atomic<bool> used{false};
+};
+
+struct Retired {
+    uint64_t epoch;
+    const void* value;
+    void (*destroy)(const void*);
+};
+
+struct Domain {
+    std::atomic<uint64_t> epoch{1};
+    ReaderSlot slots[MaxReaders];
+    std::atomic<int> nrSlots{0};            // highest slot ever used, + 1
+    std::atomic<int> unslotted{0};          // readers that found no free slot: nothing is deleted meanwhile
+    std::mutex orphansLock;
+    std::vector<Retired> orphans;           // left by the threads that exited
+
+    ~Domain() {
+        for (Retired& value : orphans)
+            value.destroy(value.value);
+    }
+};
+
+inline Domain& domain() {
+    static Domain domain;
+    return domain;
+}
+
+// Deletes the values of retired that no read section can still see
+inline void reclaim(Domain& rcu, std::vector<Retired>& retired) {
+    if (rcu.unslotted.load() > 0)
+        return;
+    uint64_t oldest = UINT64_MAX;
+    int nrSlots = rcu.nrSlots.load();
+    for (int i = 0; i < nrSlots; i++) {
+        uint64_t epoch = rcu.slots[i].epoch.load();
+        if (epoch != 0)
+            oldest = std::min(oldest, epoch);
+    }
+    auto kept = std::remove_if(retired.begin(), retired.end(), [&](const Retired& value) {
+        if (value.epoch >= oldest)
+            return false;
+        value.destroy(value.value);
+        return true;
+    });
+    retired.erase(kept, retired.end());
+}
+
+// The slot of the calling thread, claimed on its first read section and freed when it exits, and the
+// values it retired
+class ThreadSlot {
+public:
+    ThreadSlot() {
+        Domain& rcu = domain();
+        for (int i = 0; i < MaxReaders; i++) {
+            bool free = false;
+            if (rcu.slots[i].used.compare_exchange_strong(free, true)) {
+                slot = &rcu.slots[i];
+                int nrSlots = rcu.nrSlots.load();
+                while (nrSlots < i + 1 && !rcu.nrSlots.compare_exchange_weak(nrSlots, i + 1))
+                    ;
+                return;
+            }
+        }
+    }
+
+    ~ThreadSlot() {
+        if (slot != nullptr)
+            slot->used.store(false);
+        if (retired.empty())
+            return;
+        Domain& rcu = domain();
+        std::lock_guard<std::mutex> guard(rcu.orphansLock);
+        rcu.orphans.insert(rcu.orphans.end(), retired.begin(), retired.end());
+    }
+
+    // Keeps the value until the read sections that may see it are over
+    void retire(const Retired& value) {
+        retired.push_back(value);
+        if (retired.size() < RetireBatch)
+            return;
+        Domain& rcu = domain();
+        reclaim(rcu, retired);
+        std::unique_lock<std::mutex> guard(rcu.orphansLock, std::try_to_lock);
+        if (guard.owns_lock() && !rcu.orphans.empty())
+            reclaim(rcu, rcu.orphans);
+    }
+
+    ReaderSlot* slot = nullptr;             // null when all were taken
+    int depth = 0;                          // of nested read sections
+    std::vector<Retired> retired;
+};
+
+inline ThreadSlot& threadSlot() {
+    thread_local ThreadSlot slot;
+    return slot;
+}
+
+// The values read through a Published pointer stay valid until the end of the section
+class ReadSection {
+public:
+    ReadSection() : thread(threadSlot()) {
+        if (thread.depth++ > 0)
+            return;
+        Domain& rcu = domain();
+        if (thread.slot != nullptr)
+            thread.slot->epoch.store(rcu.epoch.load());
+        else
+            rcu.unslotted.fetch_add(1);
+    }
+
+    ~ReadSection() {
+        if (--thread.depth > 0)
+            return;
+        if (thread.slot != nullptr)
+            thread.slot->epoch.store(0, std::memory_order_release);
+        else
+            domain().unslotted.fetch_sub(1, std::memory_order_release);
+    }
+
+    ReadSection(const ReadSection&) = delete;
+    ReadSection& operator=(const ReadSection&) = delete;
+
+private:
+    ThreadSlot& thread;
+};
+
+// A pointer to an immutable T, read in read sections and replaced by the writers
+template<typename T>
+class Published {
+public:
+    Published() = default;
+
+    ~Published() {
+        delete value.load(std::memory_order_relaxed);
+    }
+
+    Published(const Published&) = delete;
+    Published& operator=(const Published&) = delete;
+
+    // Null until the first publish. The load is seq_cst, like the section's store of its epoch before it:
+    // an acquire load could be ordered before that store, and the writer could then reclaim the value read
+    // without seeing the section's epoch.
+    const T* read(const ReadSection&) const {
+        return value.load(std::memory_order_seq_cst);
+    }
+
+    // Readers see either the previous value or this one; the previous one is deleted when they are done
+    void publish(std::unique_ptr<const T> next) {
+        const T* previous = value.exchange(next.release());
+        if (previous == nullptr)
+            return;
+        uint64_t epoch = domain().epoch.fetch_add(1);
+        threadSlot().retire({epoch, previous, [](const void* value) { delete static_cast<const T*>(value); }});
+    }
+
+private:
+    std::atomic<const T*> value{nullptr};
+};
+
+}
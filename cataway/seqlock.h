@@ -0,0 +1,84 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <cstring>
+#include <type_traits>
+
+// A value shared between threads through a sequence lock.
+// Readers never block writers: they copy the value and retry if a write happened meanwhile.
+// Writers are serialized by the sequence itself (odd while a write is in progress).
+// Every write bumps the version, so a reader can tell cheaply whether anything changed since its last copy.
+template<typename T>
+class Seqlock {
+    static_assert(std::is_trivially_copyable<T>::value, "the value is copied word by word");
+
+public:
+    Seqlock() {
+        store(T());
+    }
+
+    // Applies change() to the current value and publishes the result; returns the new version
+    template<typename Change>
+    uint64_t update(Change change) {
+        uint64_t sequence = lockForWrite();
+        T value = load();
+        change(value);
+        store(value);
+        this->sequence.store(sequence + 2, std::memory_order_release);
+        return (sequence + 2) / 2;
+    }
+
+    // Copies a consistent value; returns its version
+    uint64_t read(T& value) const {
+        while (true) {
+            uint64_t before = sequence.load(std::memory_order_acquire);
+            if (before & 1)
+                continue;
+            value = load();
+            std::atomic_thread_fence(std::memory_order_acquire);
+            if (sequence.load(std::memory_order_relaxed) == before)
+                return before / 2;
+        }
+    }
+
+    // Version of the last complete write
+    uint64_t version() const {
+        return sequence.load(std::memory_order_acquire) / 2;
+    }
+
+private:
+    static const size_t NrWords = (sizeof(T) + sizeof(uint64_t) - 1) / sizeof(uint64_t);
+
+    uint64_t lockForWrite() {
+        uint64_t sequence = this->sequence.load(std::memory_order_relaxed);
+        while (true) {
+            if (!(sequence & 1) && this->sequence.compare_exchange_weak(sequence, sequence + 1, std::memory_order_acquire))
+                break;
+            sequence = this->sequence.load(std::memory_order_relaxed);
+        }
+        std::atomic_thread_fence(std::memory_order_release);
+        return sequence;
+    }
+
+    // The words are atomics so that a reader racing with a writer is not undefined behaviour,
+    // it only gets a torn copy that the sequence check throws away.
+    T load() const {
+        uint64_t buffer[NrWords];
+        for (size_t i = 0; i < NrWords; i++)
+            buffer[i] = words[i].load(std::memory_order_relaxed);
+        T value;
+        memcpy(&value, buffer, sizeof(T));
+        return value;
+    }
+
+    void store(const T& value) {
+        uint64_t buffer[NrWords] = {};
+        memcpy(buffer, &value, sizeof(T));
+        for (size_t i = 0; i < NrWords; i++)
+            words[i].store(buffer[i], std::memory_order_relaxed);
+    }
+
+    std::atomic<uint64_t> sequence{0};
+    std::atomic<uint64_t> words[NrWords];
+};
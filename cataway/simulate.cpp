@@ -0,0 +1,350 @@
+// Discrete-event simulation of a fleet of CatAway dispensers, on virtual time.
+//
+//   ./cataway-sim [--devices 1000] [--days 30] [--threads <cores>] [--seed 1] [--owner alert|empty]
+//                 [--reaction-hours 4]
+//
+// Every dispenser is a real CatAway on a manual clock. Its cat eats at the times of its feeding schedule
+// and drinks through the day; the owner refills both tanks some hours after the dispenser asks for it
+// (--owner alert: the tank or expiry alert) or after a tank actually ran empty (--owner empty), and
+// replaces the food when it expired. The clock jumps from one event to the next, so a month of a
+// dispenser takes well under a millisecond.
+//
+// The dispensers are independent: each one is simulated from start to end by one thread, with its own
+// random generator seeded from --seed and its index. The report (and its checksum) is the same for a
+// given seed whatever the number of threads; the dates depend on the time zone, as on a dispenser.
+//
+// Report: refill visits (the capacity plan: per day, and the busiest hour of the fleet), how far the
+// predicted refill (nextFoodRefill / nextWaterRefill) was from the moment the tank ran empty, the alerts
+// that came only after the tank was empty, and the hours the cats spent without food or water.
+
+#define CATAWAY_NO_MAIN
+#include "main.cpp"
+
+#include <queue>
+#include <random>
+
+class CatAwaySimulation {
+public:
+    struct Options {
+        int devices = 1000;
+        int days = 30;
+        int threads = static_cast<int>(max(1u, thread::hardware_concurrency()));
+        uint64_t seed = 1;
+        bool ownerWaitsForEmpty = false;
+        double reactionHours = 4;
+        time_t start = 1704067200;          // 1.1.2024 00:00 UTC
+    };
+
+    explicit CatAwaySimulation(const Options& options) : options(options) {}
+
+    void run() {
+        auto started = chrono::steady_clock::now();
+        vector<Tally> perThread(options.threads, Tally(options.days));
+        vector<thread> workers;
+        for (int t = 0; t < options.threads; t++) {
+            workers.emplace_back([this, t, &perThread] {
+                Clock clock(Clock::Manual, options.start);
+                for (int device = t; device < options.devices; device += options.threads)
+                    simulate(device, clock, perThread[t]);
+            });
+        }
+        for (auto& worker : workers)
+            worker.join();
+        double seconds = chrono::duration<double>(chrono::steady_clock::now() - started).count();
+
+        Tally total(options.days);
+        for (const Tally& tally : perThread)
+            total.add(tally);
+        report(total, seconds);
+    }
+
+private:
+    static const int MarginHours = 7 * 24;      // the margins are counted per hour, up to a week each way
+
+    // What the simulation counts; added up over the dispensers, so the order of the threads does not matter
+    struct Tally {
+        uint64_t events = 0;
+        uint64_t refills = 0;
+        uint64_t checksum = 0;                  // sum of the hashes of the final states
+        vector<uint64_t> refillsPerHour;
+        struct Tank {
+            uint64_t cycles = 0;                // from one refill to the next
+            uint64_t emptied = 0;               // cycles in which the tank ran empty
+            uint64_t lateAlerts = 0;            // ... before the dispenser asked for a refill
+            uint64_t emptySeconds = 0;
+            uint64_t margins[2 * MarginHours + 1] = {};     // empty time - predicted refill, in hours
+        } tanks[2];
+
+        explicit Tally(int days) : refillsPerHour(days * 24) {}
+
+        void add(const Tally& other) {
+            events += other.events;
+            refills += other.refills;
+            checksum += other.checksum;
+            for (size_t hour = 0; hour < refillsPerHour.size(); hour++)
+                refillsPerHour[hour] += other.refillsPerHour[hour];
+            for (int kind = 0; kind < 2; kind++) {
+                Tank& tank = tanks[kind];
+                const Tank& from = other.tanks[kind];
+                tank.cycles += from.cycles;
+                tank.emptied += from.emptied;
+                tank.lateAlerts += from.lateAlerts;
+                tank.emptySeconds += from.emptySeconds;
+                for (int i = 0; i <= 2 * MarginHours; i++)
+                    tank.margins[i] += from.margins[i];
+            }
+        }
+    };
+
+    enum EventKind { Meal, Drink, Day, AlertCheck, Refill };
+
+    struct Event {
+        time_t at;
+        uint64_t sequence;                      // events at the same time keep the order they were made in
+        EventKind kind;
+        int amount;                             // g or ml; for AlertCheck, the version of the check
+
+        bool operator>(const Event& other) const {
+            return at != other.at ? at > other.at : sequence > other.sequence;
+        }
+    };
+
+    // One refill cycle of a tank
+    struct Cycle {
+        time_t predicted = -1;                  // the prediction made at the refill, in the dispenser's time
+        time_t emptySince = -1;
+        bool alerted = false;
+    };
+
+    static uint64_t splitMix(uint64_t x) {
+        x += 0x9e3779b97f4a7c15ull;
+        x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ull;
+        x = (x ^ (x >> 27)) * 0x94d049bb133111ebull;
+        return x ^ (x >> 31);
+    }
+
+    void simulate(int index, Clock& clock, Tally& tally) {
+        using CatAway = CatAwayEndpoint::CatAway;
+        std::mt19937_64 random(splitMix(options.seed ^ splitMix(index)));
+        uniform_real_distribution<double> uniform(0, 1);
+        time_t end = options.start + time_t(options.days) * 86400;
+        clock.set(options.start);
+
+        // A cat and its dispenser, set up as its owner would
+        static const char* schedules[] = {"08:00-19:00-", "07:00-13:00-20:00-", "06:30-12:00-18:00-22:00-"};
+        static const char* speeds[] = {"slow", "medium", "fast"};
+        CatAway cat(clock);
+        float weight = round((2.5 + 4.5 * uniform(random)) * 100) / 100;
+        cat.setNumber(Setting::Weight, weight);
+        cat.setNumber(Setting::Age, round((1.5 + 14 * uniform(random)) * 100) / 100);
+        cat.set(Setting::EatingSpeed, speeds[random() % 3]);
+        cat.set(Setting::FeedingSchedule, schedules[random() % 3]);
+        cat.set(Setting::WaterRefSchedule, DefaultSchedule);
+        cat.setNumber(Setting::WaterBowlCapacityMl, 200 + 50 * (random() % 5));
+        time_t foodExpires = options.start + time_t(30 + random() % 150) * 86400;
+        cat.setFoodExpDate(foodExpires);
+        cat.setNumber(Setting::FoodIsRefilled, 1);
+        cat.setNumber(Setting::WaterIsRefilled, 1);
+
+        priority_queue<Event, vector<Event>, greater<Event>> events;
+        uint64_t sequence = 0;
+        auto schedule = [&](time_t at, EventKind kind, int amount) {
+            if (at < end)
+                events.push({at, sequence++, kind, amount});
+        };
+
+        Cycle cycles[2];
+        auto startCycles = [&] {
+            for (int kind = 0; kind < 2; kind++) {
+                cycles[kind] = Cycle();
+                cycles[kind].predicted = cat.predictedRefill(static_cast<ConsumptionEvent::Kind>(kind));
+                tally.tanks[kind].cycles++;
+            }
+        };
+        startCycles();
+
+        time_t checkAt = -1;
+        int checkVersion = 0;
+        bool refillPending = false;
+        schedule(options.start, Day, 0);
+
+        while (!events.empty()) {
+            Event event = events.top();
+            events.pop();
+            clock.set(event.at);
+            tally.events++;
+
+            switch (event.kind) {
+            case Day: {
+                // the meals and drinks of the day, on the dispenser's time
+                time_t midnight = clock.fromRomaniaTime(clock.romaniaTime() - clock.romaniaTime() % 86400);
+                Schedule meals = Schedule::parse(cat.get(Setting::FeedingSchedule));
+                int portion = stoi(cat.get(Setting::RecFoodG));
+                normal_distribution<double> jitter(0, 600);
+                for (int meal = 0; meal < meals.count; meal++) {
+                    time_t at = midnight + meals.minutes[meal] * 60 + static_cast<time_t>(jitter(random));
+                    schedule(max(at, event.at), Meal, static_cast<int>(portion * (0.7 + 0.5 * uniform(random))));
+                }
+                poisson_distribution<int> drinks(8);
+                int daily = static_cast<int>(weight * 50);                  // about 50 ml per kg
+                for (int drink = drinks(random); drink > 0; drink--)
+                    schedule(midnight + static_cast<time_t>(86400 * uniform(random)), Drink,
+                             static_cast<int>(daily / 8.0 * (0.5 + uniform(random))));
+                schedule(midnight + 86400, Day, 0);
+                break;
+            }
+            case Meal:
+                cat.consume({{ConsumptionEvent::Food, event.at, event.amount}});
+                break;
+            case Drink:
+                cat.consume({{ConsumptionEvent::Water, event.at, event.amount}});
+                break;
+            case AlertCheck:
+                if (event.amount == checkVersion)
+                    cat.checkAlerts();
+                break;
+            case Refill: {
+                refillPending = false;
+                tally.refills++;
+                tally.refillsPerHour[(event.at - options.start) / 3600]++;
+                for (int kind = 0; kind < 2; kind++)
+                    if (cycles[kind].emptySince != -1)
+                        tally.tanks[kind].emptySeconds += event.at - cycles[kind].emptySince;
+                if (foodExpires - event.at < 7 * 86400) {
+                    foodExpires = event.at + time_t(60 + random() % 120) * 86400;
+                    cat.setFoodExpDate(foodExpires);
+                }
+                cat.setNumber(Setting::FoodIsRefilled, 1);
+                cat.setNumber(Setting::WaterIsRefilled, 1);
+                startCycles();
+                break;
+            }
+            }
+
+            // what the owner sees: the alerts of the dispenser, or the tanks themselves
+            DispenserStatus status = cat.getStatus();
+            AlertState::Snapshot alerts = {status.alerts};
+            bool asked = alerts.color(AlertKind::EmptyTank) == AlertColor::Yellow
+                      || alerts.color(AlertKind::ExpiredFood) == AlertColor::Red;
+            int left[2] = {status.foodG, status.waterMl};
+            for (int kind = 0; kind < 2; kind++) {
+                Cycle& cycle = cycles[kind];
+                if (asked)
+                    cycle.alerted = true;
+                if (left[kind] > 0 || cycle.emptySince != -1)
+                    continue;
+                cycle.emptySince = event.at;
+                Tally::Tank& tank = tally.tanks[kind];
+                tank.emptied++;
+                if (!cycle.alerted)
+                    tank.lateAlerts++;
+                if (cycle.predicted != -1) {
+                    long hours = lround(double(clock.romaniaTime() - cycle.predicted) / 3600);
+                    tank.margins[max<long>(-MarginHours, min<long>(MarginHours, hours)) + MarginHours]++;
+                }
+            }
+            bool needed = options.ownerWaitsForEmpty
+                        ? left[0] == 0 || left[1] == 0 || alerts.color(AlertKind::ExpiredFood) == AlertColor::Red
+                        : asked;
+            if (needed && !refillPending) {
+                refillPending = true;
+                exponential_distribution<double> reaction(1 / (options.reactionHours * 3600));
+                schedule(event.at + 60 + static_cast<time_t>(reaction(random)), Refill, 0);
+            }
+
+            // the timer of the dispenser, as the server keeps it in its timer wheel
+            time_t next = cat.nextAlertCheck();
+            if (next != checkAt) {
+                checkAt = next;
+                checkVersion++;
+                if (next != (time_t)(-1))
+                    schedule(max(next, event.at), AlertCheck, checkVersion);
+            }
+        }
+
+        DispenserStatus status = cat.getStatus();
+        uint64_t hash = splitMix(status.alerts);
+        for (uint64_t value : {uint64_t(status.foodG), uint64_t(status.waterMl),
+                               uint64_t(cat.predictedRefill(ConsumptionEvent::Food)),
+                               uint64_t(cat.predictedRefill(ConsumptionEvent::Water))})
+            hash = splitMix(hash ^ value);
+        tally.checksum += hash;
+    }
+
+    void report(const Tally& total, double seconds) {
+        printf("%d dispensers, %d days, seed %llu, owner refills on %s after ~%.1f h, %d threads\n",
+               options.devices, options.days, static_cast<unsigned long long>(options.seed),
+               options.ownerWaitsForEmpty ? "an empty tank" : "the alert", options.reactionHours, options.threads);
+        printf("simulated %llu events in %.2f s (%.0f events/s, %.0f dispenser-days/s)\n",
+               static_cast<unsigned long long>(total.events), seconds, total.events / seconds,
+               double(options.devices) * options.days / seconds);
+
+        uint64_t busiest = *max_element(total.refillsPerHour.begin(), total.refillsPerHour.end());
+        printf("\nrefill visits: %llu, %.1f per day, %.2f per dispenser per week, busiest hour %llu\n",
+               static_cast<unsigned long long>(total.refills), double(total.refills) / options.days,
+               double(total.refills) / options.devices / options.days * 7, static_cast<unsigned long long>(busiest));
+
+        printf("\n%-6s %8s %8s %12s %12s %10s %10s %10s\n", "tank", "cycles", "emptied", "late alerts",
+               "empty hours", "margin p10", "p50", "p90");
+        const char* names[2] = {"food", "water"};
+        for (int kind = 0; kind < 2; kind++) {
+            const Tally::Tank& tank = total.tanks[kind];
+            printf("%-6s %8llu %8llu %12llu %12.1f %10s %10s %10s\n", names[kind],
+                   static_cast<unsigned long long>(tank.cycles), static_cast<unsigned long long>(tank.emptied),
+                   static_cast<unsigned long long>(tank.lateAlerts), tank.emptySeconds / 3600.0,
+                   margin(tank, 0.1).c_str(), margin(tank, 0.5).c_str(), margin(tank, 0.9).c_str());
+        }
+        printf("(margin: hours from the predicted refill to the tank running empty; negative is a late prediction)\n");
+        printf("\nchecksum %016llx\n", static_cast<unsigned long long>(total.checksum));
+    }
+
+    static string margin(const Tally::Tank& tank, double fraction) {
+        uint64_t count = 0;
+        for (uint64_t n : tank.margins)
+            count += n;
+        if (count == 0)
+            return "-";
+        uint64_t rank = static_cast<uint64_t>(fraction * (count - 1)), seen = 0;
+        for (int i = 0; i <= 2 * MarginHours; i++) {
+            seen += tank.margins[i];
+            if (seen > rank) {
+                int hours = i - MarginHours;
+                return (hours <= -MarginHours ? "<" : hours >= MarginHours ? ">" : "") + to_string(hours) + "h";
+            }
+        }
+        return "-";
+    }
+
+    Options options;
+};
+
+int main(int argc, char* argv[]) {
+    CatAwaySimulation::Options options;
+    for (int i = 1; i + 1 < argc; i += 2) {
+        string option = argv[i], value = argv[i + 1];
+        if (option == "--devices")
+            options.devices = stoi(value);
+        else if (option == "--days")
+            options.days = stoi(value);
+        else if (option == "--threads")
+            options.threads = max(1, stoi(value));
+        else if (option == "--seed")
+            options.seed = stoull(value);
+        else if (option == "--owner" && (value == "alert" || value == "empty"))
+            options.ownerWaitsForEmpty = value == "empty";
+        else if (option == "--reaction-hours")
+            options.reactionHours = stod(value);
+        else {
+            fprintf(stderr, "usage: %s [--devices n] [--days n] [--threads n] [--seed n] [--owner alert|empty]"
+                            " [--reaction-hours h]\n", argv[0]);
+            return 1;
+        }
+    }
+    if (argc % 2 == 0) {
+        fprintf(stderr, "option %s needs a value\n", argv[argc - 1]);
+        return 1;
+    }
+
+    CatAwaySimulation(options).run();
+    return 0;
+}
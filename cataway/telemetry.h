@@ -0,0 +1,133 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <string_view>
+
+#include "frames.h"
+
+// Binary telemetry frames: the input buffers of buffers.json, packed at their sizes (frames.h).
+//
+//   u16 size       of the whole frame, little-endian
+//   u8  buffer     number of the input buffer (1 .. Frames::NrBuffers)
+//   u8  idLength   of the device id (1 .. 255)
+//   u16 present    bit i set when token i of the buffer follows
+//   device id
+//   the present tokens, in the order of buffers.json
+//
+// Frames are read in place: the device id and the text tokens are views into the received bytes.
+namespace Telemetry {
+
+const size_t HeaderSize = 6;
+const size_t MaxFrameSize = 1024;
+
+// Also the byte a TCP connection is answered with, one per frame
+enum class Status : uint8_t {
+    Applied = 0,
+    Malformed = 1,              // sizes that do not add up, or an unknown buffer
+    InvalidValue = 2,           // a token that does not match its rule; nothing of the frame is applied
+    NotDurable = 3,             // applied, but the write-ahead log could not save it: send it again
+    Incomplete = 255,           // more bytes are needed (never sent)
+};
+
+struct Token {
+    int field;                  // index in Frames::fields
+    double number;              // Integer, Hundredths and Flag
+    std::string_view text;      // Text, without the padding
+};
+
+struct Frame {
+    size_t size;
+    uint8_t buffer;
+    uint16_t present;
+    std::string_view deviceId;
+    const unsigned char* tokens;
+};
+
+inline uint32_t readLittleEndian(const unsigned char* bytes, int size) {
+    uint32_t value = 0;
+    for (int i = size - 1; i >= 0; i--)
+        value = (value << 8) | bytes[i];
+    return value;
+}
+
+// Reads the header of the frame at the start of data. On Malformed, frame.size is still the size to skip
+// when it could be read and is at least a header (0 otherwise: the stream cannot be resynchronized).
+inline Status parseFrame(std::string_view data, Frame& frame) {
+    frame.size = 0;
+    if (data.size() < 2)
+        return Status::Incomplete;
+    auto bytes = reinterpret_cast<const unsigned char*>(data.data());
+    size_t size = readLittleEndian(bytes, 2);
+    if (size < HeaderSize || size > MaxFrameSize)
+        return Status::Malformed;
+    if (data.size() < size)
+        return Status::Incomplete;
+    frame.size = size;
+    frame.buffer = bytes[2];
+    frame.present = static_cast<uint16_t>(readLittleEndian(bytes + 4, 2));
+    size_t idLength = bytes[3];
+    if (frame.buffer == 0 || frame.buffer > Frames::NrBuffers || idLength == 0)
+        return Status::Malformed;
+
+    const Frames::Layout& layout = Frames::layouts[frame.buffer];
+    if (frame.present >> layout.count)
+        return Status::Malformed;
+    size_t expected = HeaderSize + idLength;
+    for (int i = 0; i < layout.count; i++)
+        if (frame.present & (1u << i))
+            expected += Frames::fields[layout.first + i].size;
+    if (expected != size)
+        return Status::Malformed;
+
+    frame.deviceId = std::string_view(data.data() + HeaderSize, idLength);
+    frame.tokens = bytes + HeaderSize + idLength;
+    return Status::Applied;
+}
+
+// Decodes the present tokens of a parsed frame and checks them against their rules; calls visit(Token)
+// for each of them only when all are valid
+template<typename Visit>
+Status forEachToken(const Frame& frame, Visit visit) {
+    const Frames::Layout& layout = Frames::layouts[frame.buffer];
+    Token tokens[16];
+    int count = 0;
+    const unsigned char* at = frame.tokens;
+    for (int i = 0; i < layout.count; i++) {
+        if (!(frame.present & (1u << i)))
+            continue;
+        const Frames::Field& field = Frames::fields[layout.first + i];
+        Token& token = tokens[count++];
+        token.field = layout.first + i;
+        token.number = 0;
+        switch (field.encoding) {
+        case Frames::Encoding::Integer:
+        case Frames::Encoding::Hundredths: {
+            uint32_t value = readLittleEndian(at, 4);
+            if (value > 999999999)          // the 9 digits the text rules allow
+                return Status::InvalidValue;
+            token.number = field.encoding == Frames::Encoding::Integer ? value : value / 100.0;
+            break;
+        }
+        case Frames::Encoding::Flag:
+            if (*at > 1)
+                return Status::InvalidValue;
+            token.number = *at;
+            break;
+        case Frames::Encoding::Text: {
+            auto text = reinterpret_cast<const char*>(at);
+            token.text = std::string_view(text, strnlen(text, field.size));
+            if (!Validators::matches(*field.validator, token.text))
+                return Status::InvalidValue;
+            break;
+        }
+        }
+        at += field.size;
+    }
+    for (int i = 0; i < count; i++)
+        visit(tokens[i]);
+    return Status::Applied;
+}
+
+}
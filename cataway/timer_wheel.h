@@ -0,0 +1,125 @@
+#pragma once
+
+#include <cstdint>
+
+// Hierarchical timing wheel (Varghese & Lauck), with 1 second ticks.
+// Levels wheels of Slots slots each: the first one holds the timers due in the next 64 s, the second one
+// those due in the next 64^2 s (a slot per minute), and so on; later timers wait in the last wheel and go
+// around it again. Timers are intrusive list nodes kept by their owner, so scheduling and cancelling are
+// O(1) and allocate nothing. Advancing one tick fires one slot and, every 64 ticks, spreads one slot of the
+// next wheel over the finer ones.
+// Not thread safe: the owner serializes the calls.
+class TimerWheel {
+public:
+    struct Timer {
+        Timer* prev = nullptr;
+        Timer* next = nullptr;
+        uint64_t expires = 0;
+
+        bool scheduled() const {
+            return next != nullptr;
+        }
+    };
+
+    static const int SlotBits = 6;
+    static const int Slots = 1 << SlotBits;
+    static const int Levels = 4;
+
+    explicit TimerWheel(uint64_t now) : now(now) {
+        for (int level = 0; level < Levels; level++)
+            for (int slot = 0; slot < Slots; slot++)
+                wheels[level][slot].prev = wheels[level][slot].next = &wheels[level][slot];
+    }
+
+    TimerWheel(const TimerWheel&) = delete;
+    TimerWheel& operator=(const TimerWheel&) = delete;
+
+    // (Re)schedules the timer; a time already passed fires on the next tick
+    void schedule(Timer& timer, uint64_t expires) {
+        cancel(timer);
+        timer.expires = expires;
+        place(timer, now + 1);
+    }
+
+    void cancel(Timer& timer) {
+        if (timer.scheduled())
+            unlink(timer);
+    }
+
+    // Moves the wheel up to the given time, calling fire(timer) for every timer that is due.
+    // fire may schedule timers again (including the one fired).
+    template<typename Fire>
+    void advance(uint64_t to, Fire fire) {
+        while (now < to) {
+            now++;
+            for (int level = 1; level < Levels; level++) {
+                if ((now >> (SlotBits * (level - 1))) & (Slots - 1))
+                    break;
+                cascade(wheels[level][(now >> (SlotBits * level)) & (Slots - 1)]);
+            }
+
+            Timer due;
+            detach(wheels[0][now & (Slots - 1)], due);
+            while (due.next != &due) {
+                Timer* timer = due.next;
+                unlink(*timer);
+                if (timer->expires <= now)
+                    fire(*timer);
+                else
+                    place(*timer, now + 1);     // a late timer from the last wheel, going around again
+            }
+        }
+    }
+
+    uint64_t time() const {
+        return now;
+    }
+
+private:
+    // Puts the timer in the slot of its time, or of the earliest one if that time is already passed
+    void place(Timer& timer, uint64_t earliest) {
+        uint64_t expires = timer.expires > earliest ? timer.expires : earliest;
+        uint64_t delta = expires - now;
+        int level = 0;
+        while (level < Levels - 1 && delta >= (uint64_t(1) << (SlotBits * (level + 1))))
+            level++;
+        Timer& head = wheels[level][(expires >> (SlotBits * level)) & (Slots - 1)];
+        timer.next = &head;
+        timer.prev = head.prev;
+        head.prev->next = &timer;
+        head.prev = &timer;
+    }
+
+    // Spreads the timers of a coarse slot over the finer wheels; those due now go to the slot about to fire
+    void cascade(Timer& head) {
+        Timer moved;
+        detach(head, moved);
+        while (moved.next != &moved) {
+            Timer* timer = moved.next;
+            unlink(*timer);
+            place(*timer, now);
+        }
+    }
+
+    // Moves a whole slot to a local list head, so the timers placed meanwhile are not seen again
+    static void detach(Timer& head, Timer& to) {
+        if (head.next == &head) {
+            to.prev = to.next = &to;
+            return;
+        }
+        to.next = head.next;
+        to.prev = head.prev;
+        to.next->prev = &to;
+        to.prev->next = &to;
+        head.prev = head.next = &head;
+    }
+
+    static void unlink(Timer& timer) {
+        timer.prev->next = timer.next;
+        timer.next->prev = timer.prev;
+        timer.prev = timer.next = nullptr;
+    }
+
+    uint64_t now;
+    Timer wheels[Levels][Slots];
+};
@@ -0,0 +1,468 @@
+#pragma once
+
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <type_traits>
+#include <vector>
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// Persistence of the dispenser state: an append-only write-ahead log plus compact snapshots.
+//
+// Every record is framed as [u32 payload size][u32 crc32][u64 lsn][u8 type][payload], so a torn write at the
+// end of a file (crash while appending) is recognised and dropped at recovery. Records are numbered by a
+// log sequence number (lsn); a snapshot is the same records back to back after a small header, which
+// names the first log generation that is not inside it.
+
+// Binary encoding of a record's payload
+class RecordWriter {
+public:
+    template<typename T>
+    void put(const T& value) {
+        static_assert(std::is_trivially_copyable<T>::value, "only plain values are copied byte by byte");
+        bytes.append(reinterpret_cast<const char*>(&value), sizeof(T));
+    }
+
+    void putString(std::string_view text) {
+        put(static_cast<uint32_t>(text.size()));
+        bytes.append(text.data(), text.size());
+    }
+
+    const std::string& data() const {
+        return bytes;
+    }
+
+private:
+    std::string bytes;
+};
+
+// Reads a payload in place (from the mapped file); ok() turns false on a short payload
+class RecordReader {
+public:
+    explicit RecordReader(std::string_view payload)
+        : pos(payload.data()), end(payload.data() + payload.size())
+    { }
+
+    template<typename T>
+    bool get(T& value) {
+        static_assert(std::is_trivially_copyable<T>::value, "only plain values are copied byte by byte");
+        if (!valid || static_cast<size_t>(end - pos) < sizeof(T))
+            return valid = false;
+        memcpy(&value, pos, sizeof(T));
+        pos += sizeof(T);
+        return true;
+    }
+
+    bool getString(std::string& text) {
+        uint32_t size;
+        if (!get(size) || static_cast<size_t>(end - pos) < size)
+            return valid = false;
+        text.assign(pos, size);
+        pos += size;
+        return true;
+    }
+
+    bool ok() const {
+        return valid;
+    }
+
+private:
+    const char* pos;
+    const char* end;
+    bool valid = true;
+};
+
+inline uint32_t crc32(const char* data, size_t size) {
+    static const auto table = [] {
+        std::vector<uint32_t> table(256);
+        for (uint32_t i = 0; i < 256; i++) {
+            uint32_t c = i;
+            for (int k = 0; k < 8; k++)
+                c = (c & 1) ? 0xEDB88320u ^ (c >> 1) : c >> 1;
+            table[i] = c;
+        }
+        return table;
+    }();
+    uint32_t crc = 0xFFFFFFFFu;
+    for (size_t i = 0; i < size; i++)
+        crc = table[(crc ^ static_cast<unsigned char>(data[i])) & 0xFF] ^ (crc >> 8);
+    return crc ^ 0xFFFFFFFFu;
+}
+
+struct LogRecord {
+    uint64_t lsn;
+    uint8_t type;
+    std::string_view payload;
+};
+
+const size_t RecordHeaderSize = 4 + 4 + 8 + 1;
+
+inline void frameRecord(std::string& out, uint64_t lsn, uint8_t type, std::string_view payload) {
+    uint32_t size = static_cast<uint32_t>(payload.size());
+    std::string body;
+    body.reserve(9 + payload.size());
+    body.append(reinterpret_cast<const char*>(&lsn), 8);
+    body.push_back(static_cast<char>(type));
+    body.append(payload.data(), payload.size());
+    uint32_t crc = crc32(body.data(), body.size());
+    out.append(reinterpret_cast<const char*>(&size), 4);
+    out.append(reinterpret_cast<const char*>(&crc), 4);
+    out.append(body);
+}
+
+// Calls apply(LogRecord) for every record of the range, up to the first incomplete or corrupt one.
+// Returns the number of bytes of valid records.
+template<typename Apply>
+size_t forEachRecord(const char* data, size_t size, Apply apply) {
+    size_t pos = 0;
+    while (size - pos >= RecordHeaderSize) {
+        uint32_t payloadSize, crc;
+        memcpy(&payloadSize, data + pos, 4);
+        memcpy(&crc, data + pos + 4, 4);
+        if (size - pos - RecordHeaderSize < payloadSize)
+            break;
+        const char* body = data + pos + 8;
+        if (crc32(body, 9 + payloadSize) != crc)
+            break;
+        LogRecord record;
+        memcpy(&record.lsn, body, 8);
+        record.type = static_cast<uint8_t>(body[8]);
+        record.payload = std::string_view(body + 9, payloadSize);
+        apply(record);
+        pos += RecordHeaderSize + payloadSize;
+    }
+    return pos;
+}
+
+// A whole file mapped read-only, for recovery without copying it through read()
+class MappedFile {
+public:
+    explicit MappedFile(const std::string& path) {
+        int fd = ::open(path.c_str(), O_RDONLY);
+        if (fd < 0)
+            return;
+        struct stat info;
+        if (fstat(fd, &info) == 0 && info.st_size > 0) {
+            void* mapped = mmap(nullptr, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (mapped != MAP_FAILED) {
+                bytes = static_cast<const char*>(mapped);
+                length = info.st_size;
+                madvise(mapped, length, MADV_SEQUENTIAL);
+            }
+        }
+        ::close(fd);
+    }
+
+    ~MappedFile() {
+        if (bytes != nullptr)
+            munmap(const_cast<char*>(bytes), length);
+    }
+
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+
+    const char* data() const { return bytes; }
+    size_t size() const { return length; }
+
+private:
+    const char* bytes = nullptr;
+    size_t length = 0;
+};
+
+const char SnapshotMagic[8] = {'C', 'A', 'T', 'S', 'N', 'A', 'P', '1'};
+
+struct SnapshotHeader {
+    char magic[8];
+    uint64_t walGeneration;     // the first log file not inside the snapshot
+    uint64_t records;
+};
+
+inline std::string walPath(const std::string& dir, uint64_t generation) {
+    return dir + "/wal." + std::to_string(generation);
+}
+
+inline std::string snapshotPath(const std::string& dir) {
+    return dir + "/snapshot";
+}
+
+// Generations of the log files found in the directory, oldest first
+inline std::vector<uint64_t> walGenerations(const std::string& dir) {
+    std::vector<uint64_t> generations;
+    DIR* listing = opendir(dir.c_str());
+    if (listing == nullptr)
+        return generations;
+    while (dirent* entry = readdir(listing)) {
+        if (strncmp(entry->d_name, "wal.", 4) != 0)
+            continue;
+        char* end;
+        uint64_t generation = strtoull(entry->d_name + 4, &end, 10);
+        if (end != entry->d_name + 4 && *end == '\0')
+            generations.push_back(generation);
+    }
+    closedir(listing);
+    std::sort(generations.begin(), generations.end());
+    return generations;
+}
+
+// fsync()s the directory, so a file just created (or renamed) in it is still there after a crash
+inline bool syncDirectory(const std::string& dir) {
+    int dirFd = ::open(dir.c_str(), O_RDONLY | O_DIRECTORY);
+    if (dirFd < 0)
+        return false;
+    bool ok = fsync(dirFd) == 0;
+    ::close(dirFd);
+    return ok;
+}
+
+// Writes the records as the new snapshot: to a temporary file first, renamed over the old one once on disk
+inline bool writeSnapshot(const std::string& dir, uint64_t walGeneration, const std::string& records, uint64_t count) {
+    std::string tmp = snapshotPath(dir) + ".tmp";
+    int fd = ::open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0)
+        return false;
+    SnapshotHeader header;
+    memcpy(header.magic, SnapshotMagic, sizeof(SnapshotMagic));
+    header.walGeneration = walGeneration;
+    header.records = count;
+    bool ok = ::write(fd, &header, sizeof(header)) == static_cast<ssize_t>(sizeof(header));
+    size_t written = 0;
+    while (ok && written < records.size()) {
+        ssize_t n = ::write(fd, records.data() + written, records.size() - written);
+        ok = n > 0;
+        written += ok ? n : 0;
+    }
+    ok = ok && fsync(fd) == 0;
+    ::close(fd);
+    if (!ok || rename(tmp.c_str(), snapshotPath(dir).c_str()) != 0)
+        return false;
+    syncDirectory(dir);
+    return true;
+}
+
+// The append side of the log, with group commit: append() only copies the record into a buffer, and a
+// single flusher thread writes the buffer and fdatasync()s it. Whoever appends while a sync is running
+// joins the next one, so one sync covers every write that arrived meanwhile.
+class WriteAheadLog {
+public:
+    static const int WriteRetries = 3;
+
+    WriteAheadLog() = default;
+    WriteAheadLog(const WriteAheadLog&) = delete;
+    WriteAheadLog& operator=(const WriteAheadLog&) = delete;
+
+    ~WriteAheadLog() {
+        close();
+    }
+
+    // Starts a new log file of the given generation; lsn continues from nextLsn
+    bool open(const std::string& dir, uint64_t generation, uint64_t nextLsn) {
+        this->dir = dir;
+        this->generation = generation;
+        this->nextLsn = nextLsn;
+        durableLsn = nextLsn - 1;
+        fd = ::open(walPath(dir, generation).c_str(), O_WRONLY | O_CREAT | O_APPEND, 0644);
+        if (fd < 0)
+            return false;
+        if (!syncDirectory(dir)) {          // the records would be synced into a file that may not survive
+            ::close(fd);
+            fd = -1;
+            return false;
+        }
+        flusher = std::thread(&WriteAheadLog::flushLoop, this);
+        return true;
+    }
+
+    bool isOpen() const {
+        return fd >= 0;
+    }
+
+    // Buffers the record; returns its lsn (0 when the log is not open)
+    uint64_t append(uint8_t type, std::string_view payload) {
+        std::lock_guard<std::mutex> guard(lock);
+        if (fd < 0)
+            return 0;
+        uint64_t lsn = nextLsn++;
+        frameRecord(pending, lsn, type, payload);
+        pendingRecords++;
+        hasPending.notify_one();
+        return lsn;
+    }
+
+    // Waits until the record is on disk; false when it could not be written (the log failed), so the
+    // change must not be acknowledged as durable
+    bool waitDurable(uint64_t lsn) {
+        std::unique_lock<std::mutex> guard(lock);
+        synced.wait(guard, [&] { return durableLsn >= lsn || failed || fd < 0; });
+        return durableLsn >= lsn;
+    }
+
+    // Set when a batch could not be written after WriteRetries attempts; cleared by the next rotation
+    // (the snapshot that follows it holds what the lost batches had)
+    bool hasFailed() {
+        std::lock_guard<std::mutex> guard(lock);
+        return failed;
+    }
+
+    // Closes the current file and continues in a new generation; returns the new generation.
+    // Everything in the older files was appended before the call returned. The switch is made by the
+    // flusher, between two batches, so appenders are never held up by it.
+    uint64_t rotate() {
+        std::unique_lock<std::mutex> guard(lock);
+        if (fd < 0)
+            return generation;
+        uint64_t requested = ++rotationsRequested;
+        hasPending.notify_one();
+        synced.wait(guard, [&] { return rotationsDone >= requested || fd < 0; });
+        return generation;
+    }
+
+    // Bytes appended to the current file
+    uint64_t size() {
+        std::lock_guard<std::mutex> guard(lock);
+        return appended + pending.size();
+    }
+
+    void close() {
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            stopping = true;
+            hasPending.notify_one();
+        }
+        if (flusher.joinable())
+            flusher.join();
+        std::lock_guard<std::mutex> guard(lock);
+        if (fd >= 0)
+            ::close(fd);
+        fd = -1;
+        synced.notify_all();
+    }
+
+    // Statistics of the group commit
+    uint64_t syncs() {
+        std::lock_guard<std::mutex> guard(lock);
+        return syncCount;
+    }
+
+    uint64_t records() {
+        std::lock_guard<std::mutex> guard(lock);
+        return recordCount;
+    }
+
+private:
+    void flushLoop() {
+        std::string batch;
+        std::unique_lock<std::mutex> guard(lock);
+        while (true) {
+            hasPending.wait(guard, [&] { return !pending.empty() || rotationsDone < rotationsRequested || stopping; });
+            if (pending.empty() && stopping)
+                return;
+            if (pending.empty()) {
+                switchFile();
+                continue;
+            }
+            batch.swap(pending);
+            uint64_t batchRecords = pendingRecords;
+            pendingRecords = 0;
+            uint64_t lastLsn = nextLsn - 1;
+            int file = fd;
+            uint64_t goodSize = appended;
+            bool skip = failed;
+            guard.unlock();
+
+            // A failed write or sync leaves the file cut back to the last synced batch, so no torn frame
+            // hides the records appended after it from recovery
+            bool ok = false;
+            for (int attempt = 0; attempt < WriteRetries && !ok && !skip; attempt++) {
+                if (attempt > 0)
+                    std::this_thread::sleep_for(std::chrono::milliseconds(10 << attempt));
+                ok = writeBatch(file, batch) && fdatasync(file) == 0;
+                if (!ok) {
+                    perror("write-ahead log");
+                    if (ftruncate(file, goodSize) != 0)
+                        break;
+                }
+            }
+
+            guard.lock();
+            if (ok) {
+                appended += batch.size();
+                durableLsn = lastLsn;
+                syncCount++;
+                recordCount += batchRecords;
+            }
+            else {
+                failed = true;
+            }
+            batch.clear();
+            if (rotationsDone < rotationsRequested)
+                switchFile();
+            synced.notify_all();
+        }
+    }
+
+    static bool writeBatch(int file, const std::string& batch) {
+        size_t written = 0;
+        while (written < batch.size()) {
+            ssize_t n = ::write(file, batch.data() + written, batch.size() - written);
+            if (n <= 0)
+                return false;
+            written += n;
+        }
+        return true;
+    }
+
+    // Called by the flusher, under the lock, with nothing buffered for the current file. The new file's
+    // directory entry is synced before any record goes into it; otherwise the log stays on the current file.
+    void switchFile() {
+        int next = ::open(walPath(dir, generation + 1).c_str(), O_WRONLY | O_CREAT | O_APPEND, 0644);
+        if (next >= 0 && !syncDirectory(dir)) {
+            ::close(next);
+            next = -1;
+        }
+        if (next >= 0) {
+            ::close(fd);
+            fd = next;
+            appended = 0;
+            generation++;
+            failed = false;
+        }
+        else {
+            perror("write-ahead log rotation");
+        }
+        rotationsDone = rotationsRequested;
+        synced.notify_all();
+    }
+
+    std::string dir;
+    uint64_t generation = 0;
+    int fd = -1;
+
+    std::mutex lock;
+    std::condition_variable hasPending;
+    std::condition_variable synced;
+    std::string pending;
+    uint64_t pendingRecords = 0;
+    uint64_t nextLsn = 1;
+    uint64_t durableLsn = 0;
+    uint64_t appended = 0;
+    uint64_t syncCount = 0;
+    uint64_t recordCount = 0;
+    uint64_t rotationsRequested = 0;
+    uint64_t rotationsDone = 0;
+    bool stopping = false;
+    bool failed = false;                    // a batch was lost: waitDurable answers false
+    std::thread flusher;
+};